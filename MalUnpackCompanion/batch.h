@@ -0,0 +1,127 @@
+#pragma once
+
+// The format of IOCTL_MUNPACK_COMPANION_BATCH: several requests sent in one round trip.
+// Portable (no OS headers required): included by the driver and by the client.
+//
+// Input:  BatchHeader, then for each command: BatchCommand, followed by its input (padded to BATCH_ALIGN)
+// Output: BatchHeader (count: the commands executed), then for each command: BatchResult, followed by the space
+//         for its output, of the size requested in the BatchCommand (padded to BATCH_ALIGN)
+
+#define BATCH_ALIGN 8
+#define BATCH_MAX_COMMANDS 64
+#define BATCH_MAX_INPUT 0x10000 // of the whole batch
+#define BATCH_MAX_OUTPUT 0x100000 // of the whole batch
+
+// flags:
+#define BATCH_STOP_ON_ERROR 1 // don't execute the commands following the failed one
+
+struct BatchHeader {
+	unsigned int count; // of the commands
+	unsigned int flags;
+};
+
+struct BatchCommand {
+	unsigned int ioctl; // the code of the request
+	unsigned int inputSize;
+	unsigned int outputSize; // the space reserved for the output
+	unsigned int reserved;
+};
+
+struct BatchResult {
+	int status; // NTSTATUS
+	unsigned int outputSize; // filled by the command
+	unsigned int capacity; // the space reserved for the output
+	unsigned int reserved;
+};
+
+typedef enum {
+	BATCH_PARSE_OK = 0,
+	BATCH_PARSE_END, // no more commands
+	BATCH_PARSE_MALFORMED
+} t_batch_parse;
+
+struct BatchCursor {
+	const unsigned char* buf;
+	unsigned long long size;
+	unsigned long long offset;
+	unsigned int index; // of the next command
+	unsigned int count;
+};
+
+namespace Batch {
+
+	inline unsigned long long alignUp(unsigned long long size)
+	{
+		return (size + (BATCH_ALIGN - 1)) & ~(unsigned long long)(BATCH_ALIGN - 1);
+	}
+
+	inline t_batch_parse begin(const void* buf, unsigned long long size, BatchHeader& hdr, BatchCursor& cursor)
+	{
+		if (!buf || size < sizeof(BatchHeader) || size > BATCH_MAX_INPUT) {
+			return BATCH_PARSE_MALFORMED;
+		}
+		hdr = *static_cast<const BatchHeader*>(buf);
+		if (hdr.count > BATCH_MAX_COMMANDS) {
+			return BATCH_PARSE_MALFORMED;
+		}
+		cursor.buf = static_cast<const unsigned char*>(buf);
+		cursor.size = size;
+		cursor.offset = sizeof(BatchHeader);
+		cursor.index = 0;
+		cursor.count = hdr.count;
+		return BATCH_PARSE_OK;
+	}
+
+	// input: points to the input of the command, inside of the parsed buffer (NULL if the command has no input)
+	inline t_batch_parse next(BatchCursor& cursor, BatchCommand& cmd, const unsigned char*& input)
+	{
+		input = nullptr;
+		if (cursor.index >= cursor.count) {
+			return BATCH_PARSE_END;
+		}
+		if (cursor.offset > cursor.size || (cursor.size - cursor.offset) < sizeof(BatchCommand)) {
+			return BATCH_PARSE_MALFORMED;
+		}
+		cmd = *reinterpret_cast<const BatchCommand*>(cursor.buf + cursor.offset);
+		const unsigned long long inputOffset = cursor.offset + sizeof(BatchCommand);
+		if (cmd.inputSize > (cursor.size - inputOffset) || cmd.outputSize > BATCH_MAX_OUTPUT) {
+			return BATCH_PARSE_MALFORMED;
+		}
+		if (cmd.inputSize) {
+			input = cursor.buf + inputOffset;
+		}
+		// the padding of the last input may be omitted:
+		cursor.offset = inputOffset + alignUp(cmd.inputSize);
+		cursor.index++;
+		return BATCH_PARSE_OK;
+	}
+
+	// validates the whole batch, and measures:
+	// outputSize: the output required for the results
+	// maxCommandBuffer: the largest buffer needed by a single command (for its input, or its output)
+	inline bool measure(const void* buf, unsigned long long size, unsigned long long& outputSize, unsigned long long& maxCommandBuffer)
+	{
+		BatchHeader hdr;
+		BatchCursor cursor;
+		if (begin(buf, size, hdr, cursor) != BATCH_PARSE_OK) {
+			return false;
+		}
+		outputSize = sizeof(BatchHeader);
+		maxCommandBuffer = 0;
+
+		BatchCommand cmd;
+		const unsigned char* input = nullptr;
+		t_batch_parse status = BATCH_PARSE_OK;
+		while ((status = next(cursor, cmd, input)) == BATCH_PARSE_OK) {
+			outputSize += sizeof(BatchResult) + alignUp(cmd.outputSize);
+			const unsigned long long cmdBuffer = (cmd.inputSize > cmd.outputSize) ? cmd.inputSize : cmd.outputSize;
+			if (cmdBuffer > maxCommandBuffer) {
+				maxCommandBuffer = cmdBuffer;
+			}
+		}
+		if (status != BATCH_PARSE_END) {
+			return false;
+		}
+		return outputSize <= BATCH_MAX_OUTPUT;
+	}
+};
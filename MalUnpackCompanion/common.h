@@ -39,6 +39,56 @@ struct ProcessFileData {
 
 typedef ProcessDataEx_v2 ProcessDataEx;
 
+// Volume-qualified identity of a file (the layout of FILE_ID_INFORMATION):
+// the file IDs alone are unique only within a volume
+struct FileKey {
+	ULONGLONG VolumeSerial;
+	ULONGLONG FileIdLow; // for the filesystems with 64-bit IDs: the IndexNumber
+	ULONGLONG FileIdHigh;
+};
+
+typedef enum {
+	NODE_EVENT_NONE = 0,
+	NODE_EVENT_ROOT_DELETED = 1, // the root process of the tree terminated
+	NODE_EVENT_TREE_EMPTY = 2, // the tree has no more processes (nor the files that were not allowed to remain): it is no longer watched
+	NODE_EVENT_FILE_DROPPED = 3, // a process from the tree created a new file
+	// recorded only in the journal:
+	NODE_EVENT_NODE_CREATED = 4, // the root process was added to the new tree
+	NODE_EVENT_PROCESS_ADDED = 5,
+	NODE_EVENT_PROCESS_DELETED = 6, // a process other than the root exited
+	NODE_EVENT_FILE_DELETED = 7,
+	COUNT_NODE_EVENT
+} t_node_event;
+
+// Returned by IOCTL_MUNPACK_COMPANION_WAIT_NODE_EVENT (only the types reported to the waiting client):
+struct NodeEvent {
+	ULONG type; // t_node_event
+	ULONG rootPid; // root of the tree that the event concerns
+	ULONG pid; // the added/deleted process, or the one that created the file
+	ULONG lostEvents; // how many events were dropped before this one, because nobody was waiting for them
+	FileKey fileKey; // the dropped/deleted file (the file events only)
+};
+
+// Input of the paged list IOCTLs:
+struct ListPageRequest {
+	ULONG Pid; // root of the tree
+	ULONG cursor; // 0: the first page, or the nextCursor returned with the previous one (opaque: not the count of the items already listed)
+};
+
+// Output of the paged list IOCTLs: followed by the page of the items
+struct ListPageHeader {
+	ULONG totalCount; // of all the items in the list
+	ULONG itemCount; // in this page
+	ULONG nextCursor; // 0: this is the last page
+	ULONG generation; // changes with each modification of the tree: if it differs between the pages, the listing must be restarted
+};
+
+// Returned by IOCTL_MUNPACK_COMPANION_MAP_JOURNAL and IOCTL_MUNPACK_COMPANION_MAP_TREES: the read-only view in the client
+struct SharedMapping {
+	ULONGLONG baseAddress;
+	ULONGLONG viewSize;
+};
+
 
 #define MUNPACK_COMPANION_DEVICE 0x8000
 
@@ -54,6 +104,8 @@ typedef ProcessDataEx_v2 ProcessDataEx;
 #define IOCTL_MUNPACK_COMPANION_LIST_PROCESSES CTL_CODE(MUNPACK_COMPANION_DEVICE, \
 	0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+// the legacy format: fills the buffer with the 64-bit file IDs, without their volumes;
+// the files with the 128-bit IDs (e.g. on ReFS) are listed as -1 (FILE_INVALID_FILE_ID) - use IOCTL_MUNPACK_COMPANION_LIST_FILE_KEYS for them
 #define IOCTL_MUNPACK_COMPANION_LIST_FILES CTL_CODE(MUNPACK_COMPANION_DEVICE, \
 	0x804, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
@@ -65,3 +117,33 @@ typedef ProcessDataEx_v2 ProcessDataEx;
 
 #define IOCTL_MUNPACK_COMPANION_DELETE_WATCHED_FILE CTL_CODE(MUNPACK_COMPANION_DEVICE, \
 	0x807, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// as IOCTL_MUNPACK_COMPANION_LIST_FILES, but fills the buffer with FileKey-s instead of the 64-bit file IDs
+#define IOCTL_MUNPACK_COMPANION_LIST_FILE_KEYS CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x808, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// stays pending until the next NodeEvent is available (instead of polling the lists), cancelled when the handle is closed
+#define IOCTL_MUNPACK_COMPANION_WAIT_NODE_EVENT CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x809, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// maps the journal of all the changes of the watched trees into the calling process
+#define IOCTL_MUNPACK_COMPANION_MAP_JOURNAL CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x80A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// maps the snapshots of the watched trees (see tree_snapshot.h) into the calling process
+#define IOCTL_MUNPACK_COMPANION_MAP_TREES CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x80B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// as IOCTL_MUNPACK_COMPANION_LIST_PROCESSES, but in pages (ListPageRequest -> ListPageHeader + PIDs)
+// (STATUS_NOT_FOUND if no tree has such root, STATUS_BUFFER_TOO_SMALL if not even one item fits in the page)
+#define IOCTL_MUNPACK_COMPANION_LIST_PROCESSES_PAGED CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x80C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// as IOCTL_MUNPACK_COMPANION_LIST_FILE_KEYS, but in pages (ListPageRequest -> ListPageHeader + FileKey-s)
+// (STATUS_NOT_FOUND if no tree has such root, STATUS_BUFFER_TOO_SMALL if not even one item fits in the page)
+#define IOCTL_MUNPACK_COMPANION_LIST_FILES_PAGED CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x80D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+// runs several requests in one round trip (see batch.h)
+#define IOCTL_MUNPACK_COMPANION_BATCH CTL_CODE(MUNPACK_COMPANION_DEVICE, \
+	0x80E, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -2,9 +2,26 @@
 #include "common.h"
 #include "process_data_struct.h"
 #include "process_util.h"
+#include "node_events.h"
+#include "journal.h"
+#include "tree_export.h"
 
 namespace Data {
 	ProcessNodesList g_ProcessNodes;
+
+	void _onNodeEvent(const NodeEvent& evt)
+	{
+		Journal::Record(evt);
+		TreeExport::Update(evt);
+		// the client waiting for the changes of the trees gets the most important ones without polling:
+		switch (evt.type) {
+			case NODE_EVENT_ROOT_DELETED:
+			case NODE_EVENT_TREE_EMPTY:
+			case NODE_EVENT_FILE_DROPPED:
+				NodeEvents::Post(evt);
+				break;
+		}
+	}
 };
 
 bool Data::AllocGlobals()
@@ -14,6 +31,7 @@ bool Data::AllocGlobals()
 		DbgPrint(DRIVER_PREFIX ": Failed to initialize data items!\n");
 		return false;
 	}
+	g_ProcessNodes.SetListener(_onNodeEvent);
 	return true;
 }
 
@@ -22,14 +40,14 @@ void Data::FreeGlobals()
 	g_ProcessNodes.destroy();
 }
 
-bool Data::ContainsFile(LONGLONG fileId)
+bool Data::ContainsFile(FileKey fileKey)
 {
-	return (g_ProcessNodes.GetFileOwner(fileId) != 0);
+	return (g_ProcessNodes.GetFileOwner(fileKey) != 0);
 }
 
-ULONG Data::GetFileOwner(LONGLONG fileId)
+ULONG Data::GetFileOwner(FileKey fileKey)
 {
-	return g_ProcessNodes.GetFileOwner(fileId);
+	return g_ProcessNodes.GetFileOwner(fileKey);
 }
 
 ULONG Data::GetProcessOwner(ULONG pid)
@@ -42,15 +60,35 @@ bool Data::ContainsProcess(ULONG pid1)
 	return g_ProcessNodes.ContainsProcess(pid1);
 }
 
+bool Data::IsAnyTreeWatched()
+{
+	return g_ProcessNodes.HasActiveNodes();
+}
+
+bool Data::MayBeWatchedProcess(ULONG pid)
+{
+	return g_ProcessNodes.MayContainProcess(pid);
+}
+
 bool Data::AreSameFamily(ULONG pid1, ULONG pid2)
 {
 	return g_ProcessNodes.AreSameFamily(pid1, pid2);
 }
 
+bool Data::IsRelatedProcess(ULONG sourcePid, ULONG targetPid, LONGLONG targetCreateTime, ULONG systemParentPid)
+{
+	return g_ProcessNodes.IsRelatedProcess(sourcePid, targetPid, targetCreateTime, systemParentPid);
+}
+
 
-bool Data::IsProcessInFileOwners(ULONG pid, LONGLONG fileId)
+bool Data::IsProcessInFileOwners(ULONG pid, FileKey fileKey)
 {
-	return g_ProcessNodes.IsProcessInFileOwners(pid, fileId);
+	return g_ProcessNodes.IsProcessInFileOwners(pid, fileKey);
+}
+
+void Data::ClassifyCaller(ULONG pid, FileKey fileKey, CallerInfo& info)
+{
+	g_ProcessNodes.ClassifyCaller(pid, fileKey, info);
 }
 
 bool Data::CanAddFile(ULONG parentPid)
@@ -58,14 +96,14 @@ bool Data::CanAddFile(ULONG parentPid)
 	return g_ProcessNodes.CanAddFile(parentPid);
 }
 
-t_add_status Data::AddFile(LONGLONG fileId, ULONG parentPid)
+t_add_status Data::AddFile(FileKey fileKey, ULONG parentPid)
 {
-	return g_ProcessNodes.AddFile(fileId, parentPid);
+	return g_ProcessNodes.AddFile(fileKey, parentPid);
 }
 
-t_add_status Data::AddProcess(ULONG pid, ULONG parentPid)
+t_add_status Data::AddCreatedProcess(ULONG pid, ULONG parentPid, ULONG creatorPid, LONGLONG createTime, ULONG& ownerPid)
 {
-	t_add_status status = g_ProcessNodes.AddProcess(pid, parentPid);
+	t_add_status status = g_ProcessNodes.AddCreatedProcess(pid, parentPid, creatorPid, createTime, ownerPid);
 	if (status == ADD_LIMIT_EXHAUSTED) {
 		DbgPrint(DRIVER_PREFIX __FUNCTION__ ": Cannot add the process: %d, terminating...\n", pid);
 		ProcessUtil::TerminateProcess(pid);
@@ -73,9 +111,9 @@ t_add_status Data::AddProcess(ULONG pid, ULONG parentPid)
 	return status;
 }
 
-t_add_status Data::AddProcessNode(ULONG pid, LONGLONG imgFileId, t_noresp respawnProtect)
+t_add_status Data::AddProcessNode(ULONG pid, FileKey imgFile, t_noresp respawnProtect)
 {
-	t_add_status status = g_ProcessNodes.AddProcessNode(pid, imgFileId, respawnProtect);
+	t_add_status status = g_ProcessNodes.AddProcessNode(pid, imgFile, respawnProtect);
 	if (status == ADD_LIMIT_EXHAUSTED) {
 		DbgPrint(DRIVER_PREFIX __FUNCTION__ ": Cannot add the process: %d, terminating...\n", pid);
 		ProcessUtil::TerminateProcess(pid);
@@ -95,9 +133,9 @@ bool Data::DeleteProcess(ULONG pid)
 	return isOk;
 }
 
-bool Data::DeleteFile(LONGLONG fileId)
+bool Data::DeleteFile(FileKey fileKey)
 {
-	bool isOk = g_ProcessNodes.DeleteFile(fileId);
+	bool isOk = g_ProcessNodes.DeleteFile(fileKey);
 	DbgPrint(DRIVER_PREFIX __FUNCTION__ ": Watched nodes: %d\n", g_ProcessNodes.CountNodes());
 	return isOk;
 }
@@ -112,7 +150,22 @@ size_t Data::CopyFilesList(ULONG parentPid, void* data, size_t outBufSize)
 	return g_ProcessNodes.CopyFilesList(parentPid, data, outBufSize);
 }
 
-NTSTATUS Data::WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER checkInterval)
+size_t Data::CopyFileIdsList(ULONG parentPid, void* data, size_t outBufSize)
+{
+	return g_ProcessNodes.CopyFileIdsList(parentPid, data, outBufSize);
+}
+
+bool Data::CopyProcessPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize)
+{
+	return g_ProcessNodes.CopyProcessPage(rootPid, cursor, header, data, outBufSize);
+}
+
+bool Data::CopyFilesPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize)
+{
+	return g_ProcessNodes.CopyFilesPage(rootPid, cursor, header, data, outBufSize);
+}
+
+NTSTATUS Data::WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER timeout)
 {
-	return g_ProcessNodes.WaitForProcessDeletion(pid, checkInterval);
+	return g_ProcessNodes.WaitForProcessDeletion(pid, timeout);
 }
@@ -2,6 +2,7 @@
 
 #include "main.h"
 #include "data_structs.h"
+#include "process_data_struct.h"
 
 
 namespace Data {
@@ -9,35 +10,55 @@ namespace Data {
 
     void FreeGlobals();
 
-    bool ContainsFile(LONGLONG fileId);
+    bool ContainsFile(FileKey fileKey);
 
-    ULONG GetFileOwner(LONGLONG fileId);
+    ULONG GetFileOwner(FileKey fileKey);
 
     ULONG  GetProcessOwner(ULONG pid);
 
     bool ContainsProcess(ULONG pid);
 
+    // lock-free: false means that nothing is watched, so the callbacks may return immediately
+    bool IsAnyTreeWatched();
+
+    // lock-free: false means the process is surely not watched
+    bool MayBeWatchedProcess(ULONG pid);
+
     bool AreSameFamily(ULONG pid1, ULONG pid2);
 
-    t_add_status AddFile(LONGLONG fileId, ULONG parentPid);
+    // the target belongs to the tree of the source, or is a child of a process from this tree
+    bool IsRelatedProcess(ULONG sourcePid, ULONG targetPid, LONGLONG targetCreateTime, ULONG systemParentPid);
+
+    t_add_status AddFile(FileKey fileKey, ULONG parentPid);
 
     bool CanAddFile(ULONG parentPid);
 
-    t_add_status AddProcess(ULONG pid, ULONG parentPid);
+    // adds the created process to the tree of its parent (or creator), ownerPid: the root of the tree
+    t_add_status AddCreatedProcess(ULONG pid, ULONG parentPid, ULONG creatorPid, LONGLONG createTime, ULONG& ownerPid);
+
+    t_add_status AddProcessNode(ULONG pid, FileKey imgFile, t_noresp respawnProtect);
 
-    t_add_status AddProcessNode(ULONG pid, LONGLONG imgFileId, t_noresp respawnProtect);
+    bool IsProcessInFileOwners(ULONG pid1, FileKey fileKey);
 
-    bool IsProcessInFileOwners(ULONG pid1, LONGLONG fileId);
+    void ClassifyCaller(ULONG pid, FileKey fileKey, CallerInfo& info);
 
     int CountProcessTrees();
 
     bool DeleteProcess(ULONG pid);
 
-    bool DeleteFile(LONGLONG fileId);
+    bool DeleteFile(FileKey fileKey);
 
     size_t CopyProcessList(ULONG rootPid, void* data, size_t outBufSize);
 
     size_t CopyFilesList(ULONG rootPid, void* data, size_t outBufSize);
 
-    NTSTATUS WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER checkInterval);
+    // as CopyFilesList, but copies the 64-bit file IDs (the legacy format)
+    size_t CopyFileIdsList(ULONG rootPid, void* data, size_t outBufSize);
+
+    // the paged variants: false if there is no tree with such root
+    bool CopyProcessPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize);
+
+    bool CopyFilesPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize);
+
+    NTSTATUS WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER timeout);
 };
@@ -1,11 +1,20 @@
 #pragma once
 
-#include <ntddk.h>
+// Portable (no OS headers required besides the primitives from platform.h):
+// the locks are passed as the template parameters, the kernel ones are in kernel_sync.h.
+
+#include "platform.h"
 
 #define DRIVER_TAG 'nUM!'
 #define INVALID_INDEX (-1)
 #define MAX_ITEMS 1024
 
+#define ITEMS_NO_LIMIT 0
+#define MIN_ITEMS_SLOTS 8
+#define MAX_ITEMS_SLOTS (1 << 24)
+
+#define PID_BITMAP_MAX_PID (1 << 20)
+
 // Mutex locker:
 
 template<typename TLock>
@@ -22,42 +31,44 @@ private:
 	TLock& _lock;
 };
 
-// Mutex:
+// Shared lock locker:
 
-class FastMutex {
-public:
-	void Init();
+template<typename TLock>
+struct AutoSharedLock {
+	AutoSharedLock(TLock& lock) : _lock(lock) {
+		_lock.LockShared();
+	}
 
-	void Lock();
-	void Unlock();
+	~AutoSharedLock() {
+		_lock.UnlockShared();
+	}
 
 private:
-	FAST_MUTEX _mutex;
+	TLock& _lock;
 };
 
-//Event 
+// Dummy lock, for the structures that are synchronized externally:
 
-class Event {
+class NoLock {
 public:
-	void Init();
+	void Init() {}
 
-	NTSTATUS WaitForEventSet(PLARGE_INTEGER timeout);
-	LONG SetEvent();
-	LONG ResetEvent();
+	void Lock() {}
+	void Unlock() {}
 
-private:
-	KEVENT _event;
+	void LockShared() {}
+	void UnlockShared() {}
 };
 
 ///
 template<typename T>
-T* AllocBuffer(size_t itemsCount = 1, bool clear = true)
+T* AllocBuffer(size_t itemsCount = 1, bool clear = true, POOL_TYPE poolType = PagedPool)
 {
 	if (itemsCount == 0) return nullptr;
 
 	const size_t size = itemsCount * sizeof(T);
-	T* buf = (T*)ExAllocatePoolWithTag(PagedPool, size, DRIVER_TAG);
-	if (clear) {
+	T* buf = (T*)ExAllocatePoolWithTag(poolType, size, DRIVER_TAG);
+	if (buf && clear) {
 		::memset(buf, 0, size);
 	}
 	return buf;
@@ -88,91 +99,88 @@ typedef enum {
 } t_add_status;
 
 
+// Hashing and the empty slot marker of the items stored in the ItemsTable:
+
 template<typename T>
-struct ItemsList
+struct ItemTraits
+{
+	static T emptyItem()
+	{
+		return T(0); // PID 0 is never added to the list
+	}
+
+	static ULONG hash(T it)
+	{
+		// Fibonacci hashing: spreads the PIDs (multiples of 4) over the table
+		return ULONG((ULONGLONG(it) * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+};
+
+///
+
+// Slot of the ItemsMap: the key with the associated value
+
+template<typename T, typename V>
+struct MapSlot
+{
+	T key;
+	V value;
+};
+
+template<typename T>
+inline T& slotKey(T& slot)
+{
+	return slot;
+}
+
+template<typename T, typename V>
+inline T& slotKey(MapSlot<T, V>& slot)
+{
+	return slot.key;
+}
+
+///
+
+// Open-addressing hash table with linear probing: the common storage of the ItemsSet and the ItemsMap.
+// The table starts small, grows geometrically as the items are added, and shrinks when they drain.
+// It has no lock of its own: the owner is responsible for the synchronization.
+
+template<typename T, typename TSlot>
+struct ItemsTable
 {
 public:
 	void init()
 	{
-		Mutex.Init();
 		ItemCount = 0;
-		MaxItemCount = 0;
+		MaxItemCount = ITEMS_NO_LIMIT;
+		SlotsCount = 0;
 		Items = NULL;
 	}
 
-	bool initItems(int maxNum = MAX_ITEMS)
+	// maxNum: the ceiling of items that can be stored (ITEMS_NO_LIMIT: grow as long as the memory allows)
+	bool initItems(int maxNum = ITEMS_NO_LIMIT)
 	{
-		return _initItems(maxNum);
+		MaxItemCount = (maxNum > 0) ? maxNum : ITEMS_NO_LIMIT;
+		return _initItems();
 	}
 
 	bool destroy()
 	{
-		AutoLock<FastMutex> lock(Mutex);
 		return _destroyItems();
 	}
 
-	size_t copyItems(void* outBuf, size_t outBufSize)
-	{
-		if (!outBuf || outBufSize < sizeof(T)) {
-			return 0;
-		}
-
-		AutoLock<FastMutex> lock(Mutex);
-		if (!Items || !ItemCount) {
-			return 0;
-		}
-		size_t maxItemsToCopy = outBufSize / sizeof(T);
-		size_t itemsToCopy = (maxItemsToCopy > (size_t)ItemCount) ? ItemCount : maxItemsToCopy;
-
-		const size_t size = itemsToCopy * sizeof(T);
-		::memset(outBuf, 0, outBufSize);
-		::memcpy(outBuf, Items, size);
-		return itemsToCopy;
-	}
-
 	int countItems()
 	{
-		AutoLock<FastMutex> lock(Mutex);
 		return ItemCount;
 	}
 
 	bool canAddItem()
 	{
-		AutoLock<FastMutex> lock(Mutex);
-		if (Items == NULL) {
-			if (!_initItems()) {
-				return false;
-			}
-		}
-		if (ItemCount >= MaxItemCount) {
-			return false;
-		}
-		return true;
-	}
-
-	t_add_status addItem(T it)
-	{
-		AutoLock<FastMutex> lock(Mutex);
-		if (Items == NULL) {
-			if (!_initItems()) {
-				return ADD_UNINITIALIZED;
-			}
-		}
-		if (ItemCount >= MaxItemCount) {
-			return ADD_LIMIT_EXHAUSTED;
-		}
-		if (_getItemIndex(it) != INVALID_INDEX) {
-			return ADD_ALREADY_EXIST;
-		}
-		if (_addItemSorted(it)) {
-			return ADD_OK;
-		}
-		return ADD_LIMIT_EXHAUSTED;
+		return _isBelowLimit();
 	}
 
 	bool containsItem(T it)
 	{
-		AutoLock<FastMutex> lock(Mutex);
 		int index = _getItemIndex(it);
 		if (index != INVALID_INDEX) {
 			return true;
@@ -182,38 +190,71 @@ public:
 
 	bool deleteItem(T it)
 	{
-		AutoLock<FastMutex> lock(Mutex);
 		int index = _getItemIndex(it);
 		if (index == INVALID_INDEX) {
 			return false;
 		}
-		if (!_shiftItemsLeft(index)) {
-			return false;
-		}
+		_removeAt(index);
 		if (ItemCount == 0) {
 			_destroyItems();
 		}
+		else if (SlotsCount > MIN_ITEMS_SLOTS && (ItemCount * 8) <= SlotsCount) {
+			// the table drained: give back the memory (if the reallocation fails, just keep the bigger table)
+			_resizeItems(SlotsCount / 2);
+		}
 		return true;
 	}
 
-private:
-	T* Items;
+protected:
+	TSlot* Items;
 	int ItemCount;
 	int MaxItemCount;
-	FastMutex Mutex;
+	int SlotsCount; // power of 2
 
-	bool _initItems(int maxNum = MAX_ITEMS)
+	// finds the slot for a new item: on ADD_OK the index points to the empty slot that should be filled
+	t_add_status _reserveSlot(T it, int& index)
+	{
+		if (it == ItemTraits<T>::emptyItem()) {
+			return ADD_INVALID_ITEM;
+		}
+		if (Items == NULL) {
+			if (!_initItems()) {
+				return ADD_UNINITIALIZED;
+			}
+		}
+		index = _findSlot(it);
+		if (!_isEmptySlot(index)) {
+			return ADD_ALREADY_EXIST;
+		}
+		if (!_isBelowLimit()) {
+			return ADD_LIMIT_EXHAUSTED;
+		}
+		// keep the load factor under 1/2, so that the probe sequences stay short:
+		if ((ItemCount + 1) * 2 > SlotsCount) {
+			if (!_resizeItems(SlotsCount * 2)) {
+				return ADD_LIMIT_EXHAUSTED;
+			}
+			index = _findSlot(it);
+		}
+		ItemCount++;
+		return ADD_OK;
+	}
+
+	bool _isBelowLimit()
+	{
+		if (MaxItemCount != ITEMS_NO_LIMIT && ItemCount >= MaxItemCount) {
+			return false;
+		}
+		return (ItemCount < MAX_ITEMS_SLOTS / 2);
+	}
+
+	bool _initItems()
 	{
 		if (Items) {
 			return true;
 		}
 		ItemCount = 0;
-		Items = AllocBuffer<T>(maxNum + 1);
-		if (Items != NULL) {
-			MaxItemCount = maxNum;
-			return true;
-		}
-		return false;
+		return _resizeItems(MIN_ITEMS_SLOTS);
 	}
 
 	bool _destroyItems()
@@ -221,94 +262,510 @@ private:
 		if (!Items) {
 			return false;
 		}
-		FreeBuffer<T>(Items, MaxItemCount);
+		FreeBuffer<TSlot>(Items, SlotsCount);
 		ItemCount = 0;
-		MaxItemCount = 0;
+		SlotsCount = 0;
 		Items = NULL;
 		return true;
 	}
 
+	// rehash all the items into a new table of the given size
+	bool _resizeItems(int newSlotsCount)
+	{
+		if (newSlotsCount < MIN_ITEMS_SLOTS || newSlotsCount > MAX_ITEMS_SLOTS) {
+			return false;
+		}
+		TSlot* newItems = AllocBuffer<TSlot>(newSlotsCount, false);
+		if (newItems == NULL) {
+			return false;
+		}
+		const T emptyIt = ItemTraits<T>::emptyItem();
+		for (int i = 0; i < newSlotsCount; i++) {
+			slotKey(newItems[i]) = emptyIt;
+		}
+		TSlot* oldItems = Items;
+		const int oldSlotsCount = SlotsCount;
+
+		Items = newItems;
+		SlotsCount = newSlotsCount;
+		for (int i = 0; i < oldSlotsCount; i++) {
+			if (slotKey(oldItems[i]) == emptyIt) continue;
+			Items[_findSlot(slotKey(oldItems[i]))] = oldItems[i];
+		}
+		FreeBuffer<TSlot>(oldItems, oldSlotsCount);
+		return true;
+	}
+
+	inline bool _isEmptySlot(int index)
+	{
+		return slotKey(Items[index]) == ItemTraits<T>::emptyItem();
+	}
+
+	inline int _homeSlot(T it)
+	{
+		return int(ItemTraits<T>::hash(it) & ULONG(SlotsCount - 1));
+	}
+
+	// returns the slot holding the item, or the empty slot where it should be inserted
+	int _findSlot(T it)
+	{
+		const int mask = SlotsCount - 1;
+		int index = _homeSlot(it);
+		while (!_isEmptySlot(index) && !(slotKey(Items[index]) == it)) {
+			index = (index + 1) & mask;
+		}
+		return index;
+	}
+
 	int _getItemIndex(T it)
 	{
 		if (!Items || ItemCount == 0) {
 			return INVALID_INDEX;
 		}
-		int start = 0;
-		int stop = ItemCount;
-		while (start < stop) {
-			int mIndx = (start + stop) / 2;
-			if (Items[mIndx] == it) {
-				return mIndx;
-			}
-			if (Items[mIndx] < it) {
-				start = mIndx + 1;
+		if (it == ItemTraits<T>::emptyItem()) {
+			return INVALID_INDEX;
+		}
+		const int index = _findSlot(it);
+		if (_isEmptySlot(index)) {
+			return INVALID_INDEX;
+		}
+		return index;
+	}
+
+	// backward-shift deletion: closes the gap, so that no tombstones are needed
+	void _removeAt(int index)
+	{
+		const int mask = SlotsCount - 1;
+		int gap = index;
+		int next = index;
+		while (true) {
+			next = (next + 1) & mask;
+			if (_isEmptySlot(next)) {
+				break;
 			}
-			else if (Items[mIndx] > it) {
-				stop = mIndx;
+			const int home = _homeSlot(slotKey(Items[next]));
+			// move the item only if its home slot is not cyclically within (gap, next]
+			const bool inRange = (gap <= next) ? (gap < home && home <= next) : (gap < home || home <= next);
+			if (!inRange) {
+				Items[gap] = Items[next];
+				gap = next;
 			}
 		}
-		return INVALID_INDEX;
+		slotKey(Items[gap]) = ItemTraits<T>::emptyItem();
+		ItemCount--;
 	}
+};
+
+///
+
+// Set of unique items
 
-	int _findFirstGreater(T it, int startIndx = 0)
+template<typename T>
+struct ItemsSet : public ItemsTable<T, T>
+{
+public:
+	size_t copyItems(void* outBuf, size_t outBufSize)
 	{
-		if (ItemCount == 0) {
-			return INVALID_INDEX;
+		if (!outBuf || outBufSize < sizeof(T)) {
+			return 0;
+		}
+
+		if (!this->Items || !this->ItemCount) {
+			return 0;
 		}
-		if (startIndx == INVALID_INDEX) {
-			startIndx = 0;
+		size_t maxItemsToCopy = outBufSize / sizeof(T);
+		size_t itemsToCopy = (maxItemsToCopy > (size_t)this->ItemCount) ? this->ItemCount : maxItemsToCopy;
+
+		::memset(outBuf, 0, outBufSize);
+		T* outItems = (T*)outBuf;
+		size_t copied = 0;
+		for (int i = 0; i < this->SlotsCount && copied < itemsToCopy; i++) {
+			if (this->_isEmptySlot(i)) continue;
+			outItems[copied++] = this->Items[i];
 		}
-		for (int i = startIndx; i < ItemCount; i++)
-		{
-			if (Items[i] > it) {
-				return i;
+		return copied;
+	}
+
+	// as copyItems, but starts from the given slot (0: the first page); nextSlot is where the next page starts, or 0 if this one is the last
+	// (the slots are stable as long as the set is not modified)
+	size_t copyItemsPage(size_t firstSlot, size_t& nextSlot, void* outBuf, size_t outBufSize)
+	{
+		nextSlot = 0;
+		if (!outBuf || outBufSize < sizeof(T)) {
+			return 0;
+		}
+		if (!this->Items || firstSlot >= (size_t)this->SlotsCount) {
+			return 0;
+		}
+		const size_t maxItemsToCopy = outBufSize / sizeof(T);
+		T* outItems = (T*)outBuf;
+		size_t copied = 0;
+		size_t i = firstSlot;
+		for (; i < (size_t)this->SlotsCount && copied < maxItemsToCopy; i++) {
+			if (this->_isEmptySlot(int(i))) continue;
+			outItems[copied++] = this->Items[i];
+		}
+		// the page is full: check if anything is left after it
+		for (; i < (size_t)this->SlotsCount; i++) {
+			if (!this->_isEmptySlot(int(i))) {
+				nextSlot = i;
+				break;
 			}
 		}
-		return ItemCount;
+		return copied;
 	}
 
-	bool _shiftItemsRight(int startIndx)
+	t_add_status addItem(T it)
 	{
-		if (startIndx == INVALID_INDEX) {
-			return false;
+		int index = INVALID_INDEX;
+		const t_add_status status = this->_reserveSlot(it, index);
+		if (status == ADD_OK) {
+			this->Items[index] = it;
 		}
-		if (ItemCount >= MaxItemCount) {
-			return false;
+		return status;
+	}
+
+	template<typename TFunc>
+	void forEachItem(TFunc func)
+	{
+		if (!this->Items) return;
+
+		for (int i = 0; i < this->SlotsCount; i++) {
+			if (this->_isEmptySlot(i)) continue;
+			func(this->Items[i]);
+		}
+	}
+};
+
+///
+
+// Map of unique keys to the associated values
+
+template<typename T, typename V>
+struct ItemsMap : public ItemsTable<T, MapSlot<T, V> >
+{
+public:
+	// adds the key, or updates the value if the key already exists
+	t_add_status setItem(T it, const V& value)
+	{
+		int index = this->_getItemIndex(it);
+		if (index != INVALID_INDEX) {
+			this->Items[index].value = value;
+			return ADD_ALREADY_EXIST;
 		}
-		for (int i = ItemCount; i > startIndx; i--) {
-			Items[i] = Items[i - 1];
+		const t_add_status status = this->_reserveSlot(it, index);
+		if (status == ADD_OK) {
+			this->Items[index].key = it;
+			this->Items[index].value = value;
 		}
-		ItemCount++;
-		return true;
+		return status;
 	}
 
-	bool _shiftItemsLeft(int startIndx)
+	bool getItem(T it, V& value)
 	{
-		if (startIndx == INVALID_INDEX) {
+		const int index = this->_getItemIndex(it);
+		if (index == INVALID_INDEX) {
 			return false;
 		}
-		for (int i = startIndx + 1; i < ItemCount; i++) {
-			Items[i - 1] = Items[i];
+		value = this->Items[index].value;
+		return true;
+	}
+};
+
+///
+
+// Set of unique items, guarded by the lock of the given type
+// (NoLock: the owner of the list is responsible for the synchronization)
+
+template<typename T, typename TLock>
+struct ItemsList
+{
+public:
+	void init()
+	{
+		Mutex.Init();
+		Set.init();
+	}
+
+	// maxNum: the ceiling of items that can be stored (ITEMS_NO_LIMIT: grow as long as the memory allows)
+	bool initItems(int maxNum = ITEMS_NO_LIMIT)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.initItems(maxNum);
+	}
+
+	bool destroy()
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.destroy();
+	}
+
+	size_t copyItems(void* outBuf, size_t outBufSize)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.copyItems(outBuf, outBufSize);
+	}
+
+	size_t copyItemsPage(size_t firstSlot, size_t& nextSlot, void* outBuf, size_t outBufSize)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.copyItemsPage(firstSlot, nextSlot, outBuf, outBufSize);
+	}
+
+	int countItems()
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.countItems();
+	}
+
+	bool canAddItem()
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.canAddItem();
+	}
+
+	t_add_status addItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.addItem(it);
+	}
+
+	bool containsItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.containsItem(it);
+	}
+
+	bool deleteItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return Set.deleteItem(it);
+	}
+
+	template<typename TFunc>
+	void forEachItem(TFunc func)
+	{
+		AutoLock<TLock> lock(Mutex);
+		Set.forEachItem(func);
+	}
+
+private:
+	ItemsSet<T> Set;
+	TLock Mutex;
+};
+
+///
+
+// Set of unique items that keeps up to InlineMax items inside the structure itself,
+// and spills them to a heap-allocated ItemsSet only when there are more of them.
+// It has no lock of its own: the owner is responsible for the synchronization.
+// The structure can be moved with memcpy.
+
+template<typename T, int InlineMax>
+struct SmallItemsList
+{
+public:
+	void init()
+	{
+		InlineCount = 0;
+		Spilled.init();
+	}
+
+	bool destroy()
+	{
+		InlineCount = 0;
+		return Spilled.destroy();
+	}
+
+	size_t copyItems(void* outBuf, size_t outBufSize)
+	{
+		if (_isSpilled()) {
+			return Spilled.copyItems(outBuf, outBufSize);
+		}
+		if (!outBuf || outBufSize < sizeof(T) || !InlineCount) {
+			return 0;
+		}
+		size_t maxItemsToCopy = outBufSize / sizeof(T);
+		size_t itemsToCopy = (maxItemsToCopy > (size_t)InlineCount) ? InlineCount : maxItemsToCopy;
+
+		::memset(outBuf, 0, outBufSize);
+		::memcpy(outBuf, InlineItems, itemsToCopy * sizeof(T));
+		return itemsToCopy;
+	}
+
+	// inline, the slot is the index of the item
+	size_t copyItemsPage(size_t firstSlot, size_t& nextSlot, void* outBuf, size_t outBufSize)
+	{
+		if (_isSpilled()) {
+			return Spilled.copyItemsPage(firstSlot, nextSlot, outBuf, outBufSize);
+		}
+		nextSlot = 0;
+		if (!outBuf || outBufSize < sizeof(T) || firstSlot >= (size_t)InlineCount) {
+			return 0;
+		}
+		const size_t maxItemsToCopy = outBufSize / sizeof(T);
+		const size_t remaining = InlineCount - firstSlot;
+		const size_t itemsToCopy = (maxItemsToCopy > remaining) ? remaining : maxItemsToCopy;
+		::memcpy(outBuf, &InlineItems[firstSlot], itemsToCopy * sizeof(T));
+		if (itemsToCopy < remaining) {
+			nextSlot = firstSlot + itemsToCopy;
+		}
+		return itemsToCopy;
+	}
+
+	int countItems()
+	{
+		if (_isSpilled()) {
+			return Spilled.countItems();
+		}
+		return InlineCount;
+	}
+
+	bool canAddItem()
+	{
+		if (_isSpilled()) {
+			return Spilled.canAddItem();
 		}
-		Items[ItemCount - 1] = 0;
-		ItemCount--;
 		return true;
 	}
 
-	bool _addItemSorted(T it)
+	t_add_status addItem(T it)
 	{
-		int itIndx = _getItemIndex(it);
-		int indx = _findFirstGreater(it, itIndx);
-		if (indx == INVALID_INDEX) {
-			Items[ItemCount++] = it;
+		if (_isSpilled()) {
+			return Spilled.addItem(it);
+		}
+		if (it == ItemTraits<T>::emptyItem()) {
+			return ADD_INVALID_ITEM;
+		}
+		if (_getInlineIndex(it) != INVALID_INDEX) {
+			return ADD_ALREADY_EXIST;
+		}
+		if (InlineCount < InlineMax) {
+			InlineItems[InlineCount++] = it;
+			return ADD_OK;
+		}
+		// no more space inline, move all the items to the heap:
+		for (int i = 0; i < InlineCount; i++) {
+			if (Spilled.addItem(InlineItems[i]) != ADD_OK) {
+				Spilled.destroy();
+				return ADD_LIMIT_EXHAUSTED;
+			}
+		}
+		const t_add_status status = Spilled.addItem(it);
+		if (status != ADD_OK) {
+			Spilled.destroy();
+			return status;
+		}
+		InlineCount = 0;
+		return ADD_OK;
+	}
+
+	bool containsItem(T it)
+	{
+		if (_isSpilled()) {
+			return Spilled.containsItem(it);
+		}
+		return (_getInlineIndex(it) != INVALID_INDEX);
+	}
+
+	bool deleteItem(T it)
+	{
+		if (_isSpilled()) {
+			if (!Spilled.deleteItem(it)) {
+				return false;
+			}
+			if (Spilled.countItems() <= (InlineMax / 2)) {
+				// the list drained: move the remaining items back inline, and free the heap
+				InlineCount = int(Spilled.copyItems(InlineItems, sizeof(InlineItems)));
+				Spilled.destroy();
+			}
 			return true;
 		}
-		if (!_shiftItemsRight(indx)) {
+		const int index = _getInlineIndex(it);
+		if (index == INVALID_INDEX) {
 			return false;
 		}
-		Items[indx] = it;
+		// the order does not matter: fill the gap with the last item
+		InlineItems[index] = InlineItems[InlineCount - 1];
+		InlineCount--;
 		return true;
 	}
+
+	template<typename TFunc>
+	void forEachItem(TFunc func)
+	{
+		if (_isSpilled()) {
+			Spilled.forEachItem(func);
+			return;
+		}
+		for (int i = 0; i < InlineCount; i++) {
+			func(InlineItems[i]);
+		}
+	}
+
+private:
+	T InlineItems[InlineMax];
+	int InlineCount;
+	ItemsSet<T> Spilled; // used only when the items do not fit inline
+
+	inline bool _isSpilled()
+	{
+		return Spilled.countItems() > 0;
+	}
+
+	int _getInlineIndex(T it)
+	{
+		for (int i = 0; i < InlineCount; i++) {
+			if (InlineItems[i] == it) {
+				return i;
+			}
+		}
+		return INVALID_INDEX;
+	}
+};
+
+//---
+
+// Lock-free set of PIDs, with one bit per PID/4 (Windows PIDs are multiples of 4).
+// Answers "may the PID be in the set" with a single memory load: PIDs beyond the range
+// are always reported as possibly contained, so the caller must fall back to the exact check.
+
+struct PidBitmap
+{
+public:
+	void init()
+	{
+		::memset((void*)Bits, 0, sizeof(Bits));
+	}
+
+	void setPid(ULONG pid)
+	{
+		if (!_isInRange(pid)) return;
+		InterlockedOr(&Bits[_wordIndex(pid)], _bitMask(pid));
+	}
+
+	void clearPid(ULONG pid)
+	{
+		if (!_isInRange(pid)) return;
+		InterlockedAnd(&Bits[_wordIndex(pid)], ~_bitMask(pid));
+	}
+
+	bool mayContainPid(ULONG pid) const
+	{
+		if (!_isInRange(pid)) return true;
+		return (Bits[_wordIndex(pid)] & _bitMask(pid)) != 0;
+	}
+
+private:
+	static const ULONG BITS_PER_WORD = sizeof(LONG) * 8;
+
+	volatile LONG Bits[(PID_BITMAP_MAX_PID / 4) / BITS_PER_WORD];
+
+	static inline bool _isInRange(ULONG pid) { return pid < PID_BITMAP_MAX_PID; }
+
+	static inline ULONG _wordIndex(ULONG pid) { return (pid >> 2) / BITS_PER_WORD; }
+
+	static inline LONG _bitMask(ULONG pid) { return LONG(1UL << ((pid >> 2) % BITS_PER_WORD)); }
 };
 
 //---
@@ -0,0 +1,171 @@
+#include "file_id_cache.h"
+#include "common.h"
+#include "data_structs.h"
+#include "kernel_sync.h"
+
+struct FileIdCacheEntry
+{
+	ULONG hash;
+	USHORT nameLen; // in bytes, 0 if the entry is empty
+	FileKey fileKey;
+	WCHAR name[FILE_ID_CACHE_MAX_NAME];
+};
+
+namespace FileIdCache {
+	FileIdCacheEntry* g_Entries = nullptr;
+	PushLock g_Lock;
+	volatile LONG g_Generation = 0;
+	volatile LONG g_Count = 0;
+
+	ULONG _hashName(PCUNICODE_STRING FileName)
+	{
+		// FNV-1a of the upcased name, the names are compared case-insensitive:
+		ULONG hash = 2166136261UL;
+		const USHORT len = FileName->Length / sizeof(WCHAR);
+		for (USHORT i = 0; i < len; i++) {
+			hash ^= RtlUpcaseUnicodeChar(FileName->Buffer[i]);
+			hash *= 16777619UL;
+		}
+		return hash;
+	}
+
+	inline bool _isCacheable(PCUNICODE_STRING FileName)
+	{
+		if (!FileName || !FileName->Buffer || !FileName->Length) {
+			return false;
+		}
+		return (FileName->Length <= (FILE_ID_CACHE_MAX_NAME * sizeof(WCHAR)));
+	}
+
+	inline FileIdCacheEntry& _slotOf(ULONG hash)
+	{
+		return g_Entries[hash & (FILE_ID_CACHE_SLOTS - 1)];
+	}
+
+	inline bool _isMatching(const FileIdCacheEntry& entry, ULONG hash, PCUNICODE_STRING FileName)
+	{
+		if (entry.nameLen == 0 || entry.hash != hash || entry.nameLen != FileName->Length) {
+			return false;
+		}
+		UNICODE_STRING entryName = { entry.nameLen, entry.nameLen, (PWCH)entry.name };
+		return RtlEqualUnicodeString(&entryName, FileName, TRUE) ? true : false;
+	}
+
+	inline void _clearEntry(FileIdCacheEntry& entry)
+	{
+		if (entry.nameLen) {
+			entry.nameLen = 0;
+			InterlockedDecrement(&g_Count);
+		}
+	}
+};
+
+bool FileIdCache::Init()
+{
+	g_Lock.Init();
+	g_Generation = 0;
+	g_Count = 0;
+	g_Entries = AllocBuffer<FileIdCacheEntry>(FILE_ID_CACHE_SLOTS);
+	if (!g_Entries) {
+		DbgPrint(DRIVER_PREFIX ": Failed to initialize the FileId cache!\n");
+		return false;
+	}
+	return true;
+}
+
+void FileIdCache::Destroy()
+{
+	AutoLock<PushLock> lock(g_Lock);
+	FreeBuffer<FileIdCacheEntry>(g_Entries, FILE_ID_CACHE_SLOTS);
+	g_Entries = nullptr;
+	g_Count = 0;
+}
+
+LONG FileIdCache::GetGeneration()
+{
+	return g_Generation;
+}
+
+bool FileIdCache::Lookup(PCUNICODE_STRING FileName, FileKey& Key)
+{
+	if (!_isCacheable(FileName) || IsEmpty()) {
+		return false;
+	}
+	const ULONG hash = _hashName(FileName);
+
+	AutoSharedLock<PushLock> lock(g_Lock);
+	if (!g_Entries) {
+		return false;
+	}
+	const FileIdCacheEntry& entry = _slotOf(hash);
+	if (!_isMatching(entry, hash, FileName)) {
+		return false;
+	}
+	Key = entry.fileKey;
+	return true;
+}
+
+void FileIdCache::Store(PCUNICODE_STRING FileName, const FileKey& Key, LONG generation)
+{
+	if (!_isCacheable(FileName) || !FileKeys::isValid(Key)) {
+		return;
+	}
+	const ULONG hash = _hashName(FileName);
+
+	AutoLock<PushLock> lock(g_Lock);
+	if (!g_Entries || generation != g_Generation) {
+		// something was invalidated in the meantime, so the fetched ID may be stale
+		return;
+	}
+	FileIdCacheEntry& entry = _slotOf(hash);
+	if (!entry.nameLen) {
+		InterlockedIncrement(&g_Count);
+	}
+	// direct-mapped: the previous entry in the slot is just overwritten
+	entry.hash = hash;
+	entry.fileKey = Key;
+	entry.nameLen = FileName->Length;
+	::memcpy(entry.name, FileName->Buffer, FileName->Length);
+}
+
+void FileIdCache::Invalidate(PCUNICODE_STRING FileName)
+{
+	if (!_isCacheable(FileName)) {
+		return;
+	}
+	const ULONG hash = _hashName(FileName);
+
+	AutoLock<PushLock> lock(g_Lock);
+	InterlockedIncrement(&g_Generation);
+	if (!g_Entries) {
+		return;
+	}
+	FileIdCacheEntry& entry = _slotOf(hash);
+	if (_isMatching(entry, hash, FileName)) {
+		_clearEntry(entry);
+	}
+}
+
+void FileIdCache::RejectPendingStores()
+{
+	// under the lock: a store either completed before (so the cache is not empty), or will see the new generation
+	AutoLock<PushLock> lock(g_Lock);
+	InterlockedIncrement(&g_Generation);
+}
+
+void FileIdCache::Flush()
+{
+	AutoLock<PushLock> lock(g_Lock);
+	InterlockedIncrement(&g_Generation);
+	if (!g_Entries) {
+		return;
+	}
+	for (size_t i = 0; i < FILE_ID_CACHE_SLOTS; i++) {
+		_clearEntry(g_Entries[i]);
+	}
+}
+
+bool FileIdCache::IsEmpty()
+{
+	return g_Count == 0;
+}
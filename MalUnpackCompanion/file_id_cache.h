@@ -0,0 +1,36 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "file_key.h"
+
+#define FILE_ID_CACHE_SLOTS 256 // must be a power of 2
+#define FILE_ID_CACHE_MAX_NAME 256 // in WCHARs, longer names are not cached
+
+// A bounded cache: normalized file name -> file key.
+// Saves the nested open of the file when the same name is queried repeatedly.
+// The entries must be invalidated whenever the name may start pointing to another file (create, overwrite, rename).
+
+namespace FileIdCache {
+
+    bool Init();
+
+    void Destroy();
+
+    // to be fetched before retrieving the ID that is going to be stored:
+    LONG GetGeneration();
+
+    bool Lookup(PCUNICODE_STRING FileName, FileKey& Key);
+
+    // stores the ID only if nothing was invalidated since the generation was fetched
+    void Store(PCUNICODE_STRING FileName, const FileKey& Key, LONG generation);
+
+    void Invalidate(PCUNICODE_STRING FileName);
+
+    // makes the stores of the IDs fetched until now fail: to be called when a name may have been remapped,
+    // if nothing was stored before (IsEmpty), no other invalidation is needed
+    void RejectPendingStores();
+
+    void Flush();
+
+    bool IsEmpty();
+};
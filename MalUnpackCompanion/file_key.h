@@ -0,0 +1,98 @@
+#pragma once
+
+#include <fltKernel.h>
+
+#include "common.h"
+#include "data_structs.h"
+
+#ifndef FILE_INVALID_FILE_ID
+	#define FILE_INVALID_FILE_ID               ((LONGLONG)-1LL)
+#endif
+
+// for printing the keys in the logs:
+#define FILE_KEY_FMT "%llX:%llX%016llX"
+#define FILE_KEY_ARGS(key) (key).VolumeSerial, (key).FileIdHigh, (key).FileIdLow
+
+inline bool operator==(const FileKey& key1, const FileKey& key2)
+{
+	return key1.FileIdLow == key2.FileIdLow
+		&& key1.FileIdHigh == key2.FileIdHigh
+		&& key1.VolumeSerial == key2.VolumeSerial;
+}
+
+inline bool operator!=(const FileKey& key1, const FileKey& key2)
+{
+	return !(key1 == key2);
+}
+
+namespace FileKeys {
+
+	inline FileKey invalidKey()
+	{
+		FileKey key;
+		key.VolumeSerial = 0;
+		key.FileIdLow = ULONGLONG(FILE_INVALID_FILE_ID);
+		key.FileIdHigh = ULONGLONG(FILE_INVALID_FILE_ID);
+		return key;
+	}
+
+	// the same definition as the equality (and the empty slot of the hash tables): the keys are built only by the functions below,
+	// which never produce an invalid ID with another volume serial
+	inline bool isValid(const FileKey& key)
+	{
+		return key != invalidKey();
+	}
+
+	inline FileKey fromIdInfo(const FILE_ID_INFORMATION& info)
+	{
+		FileKey key;
+		key.VolumeSerial = info.VolumeSerialNumber;
+		::memcpy(&key.FileIdLow, &info.FileId.Identifier[0], sizeof(key.FileIdLow));
+		::memcpy(&key.FileIdHigh, &info.FileId.Identifier[sizeof(key.FileIdLow)], sizeof(key.FileIdHigh));
+		if (key.FileIdLow == ULONGLONG(FILE_INVALID_FILE_ID) && key.FileIdHigh == ULONGLONG(FILE_INVALID_FILE_ID)) {
+			return invalidKey(); // FILE_INVALID_FILE_ID_128
+		}
+		return key;
+	}
+
+	// for the filesystems that do not support FileIdInformation: the 64-bit ID is extended the same way as the FILE_ID_128 of NTFS
+	inline FileKey fromIndexNumber(ULONGLONG volumeSerial, LONGLONG indexNumber)
+	{
+		if (indexNumber == FILE_INVALID_FILE_ID) {
+			return invalidKey();
+		}
+		FileKey key;
+		key.VolumeSerial = volumeSerial;
+		key.FileIdLow = ULONGLONG(indexNumber);
+		key.FileIdHigh = 0;
+		return key;
+	}
+
+	// the 64-bit ID, as reported by the legacy interfaces: FILE_INVALID_FILE_ID if the ID does not fit in 64 bits
+	// (rather than truncated, so that it is never mistaken for the ID of another file)
+	inline LONGLONG toFileId(const FileKey& key)
+	{
+		if (!isValid(key) || key.FileIdHigh != 0) {
+			return FILE_INVALID_FILE_ID;
+		}
+		return LONGLONG(key.FileIdLow);
+	}
+};
+
+template<>
+struct ItemTraits<FileKey>
+{
+	static FileKey emptyItem()
+	{
+		return FileKeys::invalidKey();
+	}
+
+	static ULONG hash(const FileKey& it)
+	{
+		// fold the 128-bit ID with the volume serial, then spread it as the scalar keys
+		const ULONGLONG folded = it.FileIdLow
+			^ (it.FileIdHigh * 0xC2B2AE3D27D4EB4FULL)
+			^ (it.VolumeSerial * 0x165667B19E3779F9ULL);
+		return ULONG((folded * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+};
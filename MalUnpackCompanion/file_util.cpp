@@ -31,9 +31,9 @@ bool FileUtil::RetrieveImagePath(PIMAGE_INFO ImageInfo, WCHAR FileName[FileUtil:
     return isOk;
 }
 
-NTSTATUS FileUtil::FetchFileId(HANDLE hFile, LONGLONG &FileId)
+NTSTATUS FileUtil::FetchFileKey(HANDLE hFile, FileKey& Key)
 {
-    FileId = FILE_INVALID_FILE_ID;
+    Key = FileKeys::invalidKey();
 
     if (!hFile) {
         return STATUS_INVALID_PARAMETER;
@@ -43,16 +43,42 @@ NTSTATUS FileUtil::FetchFileId(HANDLE hFile, LONGLONG &FileId)
     __try
     {
         IO_STATUS_BLOCK ioStatusBlock;
-        FILE_INTERNAL_INFORMATION fileIdInfo;
+        FILE_ID_INFORMATION fileIdInfo = { 0 };
         status = ZwQueryInformationFile(
             hFile,
             &ioStatusBlock,
             &fileIdInfo,
             sizeof(fileIdInfo),
-            FileInternalInformation
+            FileIdInformation
         );
         if (NT_SUCCESS(status)) {
-            FileId = fileIdInfo.IndexNumber.QuadPart;
+            Key = FileKeys::fromIdInfo(fileIdInfo);
+            return status;
+        }
+        // not supported by the filesystem (or the system is older than Windows 8): build the key from the 64-bit ID
+        FILE_INTERNAL_INFORMATION internalInfo = { 0 };
+        status = ZwQueryInformationFile(
+            hFile,
+            &ioStatusBlock,
+            &internalInfo,
+            sizeof(internalInfo),
+            FileInternalInformation
+        );
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+        // the label does not need to fit, only the serial number is used:
+        FILE_FS_VOLUME_INFORMATION volumeInfo = { 0 };
+        status = ZwQueryVolumeInformationFile(
+            hFile,
+            &ioStatusBlock,
+            &volumeInfo,
+            sizeof(volumeInfo),
+            FileFsVolumeInformation
+        );
+        if (NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW) {
+            Key = FileKeys::fromIndexNumber(volumeInfo.VolumeSerialNumber, internalInfo.IndexNumber.QuadPart);
+            status = STATUS_SUCCESS;
         }
     }
     __except (EXCEPTION_EXECUTE_HANDLER)
@@ -98,18 +124,52 @@ NTSTATUS FileUtil::FetchFileSize(HANDLE hFile, LONGLONG& FileSize)
     return status;
 }
 
+NTSTATUS FileUtil::FetchIndexNumber(HANDLE hFile, LONGLONG& IndexNumber)
+{
+    IndexNumber = FILE_INVALID_FILE_ID;
+
+    if (!hFile) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    __try
+    {
+        IO_STATUS_BLOCK ioStatusBlock = { 0 };
+        FILE_INTERNAL_INFORMATION internalInfo = { 0 };
+        status = ZwQueryInformationFile(
+            hFile,
+            &ioStatusBlock,
+            &internalInfo,
+            sizeof(internalInfo),
+            FileInternalInformation
+        );
+        if (NT_SUCCESS(status)) {
+            IndexNumber = internalInfo.IndexNumber.QuadPart;
+        }
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        status = GetExceptionCode();
+        DbgPrint(DRIVER_PREFIX __FUNCTION__" [!!!] Exception thrown\n");
+    }
+    return status;
+}
 
-LONGLONG FileUtil::GetFileIdByPath(PUNICODE_STRING FileName)
+FileKey FileUtil::GetFileKeyByPath(PUNICODE_STRING FileName, LONGLONG* IndexNumber)
 {
+    if (IndexNumber) {
+        *IndexNumber = FILE_INVALID_FILE_ID;
+    }
     if (!FileName || !FileName->Buffer || !FileName->Length) {
-        return (FILE_INVALID_FILE_ID);
+        return FileKeys::invalidKey();
     }
     if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
-        return (FILE_INVALID_FILE_ID);
+        return FileKeys::invalidKey();
     }
     OBJECT_ATTRIBUTES objAttr;
     InitializeObjectAttributes(&objAttr, FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
-    LONGLONG FileId = FILE_INVALID_FILE_ID;
+    FileKey Key = FileKeys::invalidKey();
     __try
     {
         HANDLE hFile = NULL;
@@ -125,7 +185,10 @@ LONGLONG FileUtil::GetFileIdByPath(PUNICODE_STRING FileName)
             0
         );
         if (NT_SUCCESS(status)) {
-            FetchFileId(hFile, FileId);
+            FetchFileKey(hFile, Key);
+            if (IndexNumber) {
+                FetchIndexNumber(hFile, *IndexNumber);
+            }
             ZwClose(hFile);
         }
         else {
@@ -134,9 +197,9 @@ LONGLONG FileUtil::GetFileIdByPath(PUNICODE_STRING FileName)
     }
     __except (EXCEPTION_EXECUTE_HANDLER)
     {
-        FileId = FILE_INVALID_FILE_ID;
+        Key = FileKeys::invalidKey();
     }
-    return FileId;
+    return Key;
 }
 
 NTSTATUS FileUtil::RequestFileDeletion(PUNICODE_STRING FileName)
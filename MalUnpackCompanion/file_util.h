@@ -1,6 +1,7 @@
 #pragma once
 
 #include "undoc_api.h"
+#include "file_key.h"
 
 #define INVALID_FILE_SIZE (-1)
 
@@ -10,11 +11,15 @@ namespace FileUtil {
 
     bool RetrieveImagePath(PIMAGE_INFO ImageInfo, WCHAR FileName[MAX_PATH_LEN]);
 
-    NTSTATUS FetchFileId(HANDLE hFile, LONGLONG& FileId);
+    NTSTATUS FetchFileKey(HANDLE hFile, FileKey& Key);
 
     NTSTATUS FetchFileSize(HANDLE hFile, LONGLONG& FileSize);
 
-    LONGLONG GetFileIdByPath(PUNICODE_STRING FileName);
+    // the 64-bit ID of the file (FileInternalInformation): the one that the user-mode sees as nFileIndex
+    NTSTATUS FetchIndexNumber(HANDLE hFile, LONGLONG& IndexNumber);
+
+    // IndexNumber (optional): receives also the 64-bit ID of the file, or FILE_INVALID_FILE_ID
+    FileKey GetFileKeyByPath(PUNICODE_STRING FileName, LONGLONG* IndexNumber = NULL);
 
     NTSTATUS RequestFileDeletion(PUNICODE_STRING FileName);
 };
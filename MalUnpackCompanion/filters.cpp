@@ -14,16 +14,21 @@ OB_PREOP_CALLBACK_STATUS OnPreOpenProcess(PVOID RegistrationContext, POB_PRE_OPE
 	if (Info->KernelHandle) {
 		return OB_PREOP_SUCCESS; //do not interfere in kernel mode operations
 	}
+	if (!Data::IsAnyTreeWatched()) {
+		return OB_PREOP_SUCCESS; //nothing is watched, do not interfere
+	}
 	const ULONG sourcePID = HandleToULong(PsGetCurrentProcessId()); //the PID of the process performing the operation
-	if (!Data::ContainsProcess(sourcePID)) {
+	if (!Data::ContainsProcess(sourcePID)) { // checks the lock-free PID bitmap first
 		return OB_PREOP_SUCCESS; //do not interfere
 	}
 
 	PEPROCESS targetProcess = (PEPROCESS)Info->Object;
 	const ULONG targetPid = HandleToULong(PsGetProcessId(targetProcess));
 
-	const bool isMyProcess = Data::AreSameFamily(targetPid, sourcePID) 
-		|| Data::AreSameFamily(ProcessUtil::GetProcessParentPID(targetProcess), sourcePID) ;
+	// the parent recorded at the creation is used if available, otherwise the one reported by the system:
+	const bool isMyProcess = Data::IsRelatedProcess(sourcePID, targetPid,
+		PsGetProcessCreateTimeQuadPart(targetProcess),
+		ProcessUtil::GetProcessParentPID(targetProcess));
 
 	if (isMyProcess) {
 		DbgPrint(DRIVER_PREFIX "[%d] Allowing opening handle to a child: [%d]\n", sourcePID, targetPid);
@@ -88,24 +93,72 @@ OB_PREOP_CALLBACK_STATUS OnPreOpenProcess(PVOID RegistrationContext, POB_PRE_OPE
 }
 
 
+// The registry operations that are blocked for the watched processes:
+
+struct RegNotifyFilter
+{
+	bool isFiltered[MaxRegNtNotifyClass];
+};
+
+constexpr RegNotifyFilter _makeRegNotifyFilter()
+{
+	RegNotifyFilter filter = {};
+	filter.isFiltered[RegNtPreCreateKey] = true;
+	filter.isFiltered[RegNtSetValueKey] = true;
+	filter.isFiltered[RegNtPreDeleteKey] = true;
+	filter.isFiltered[RegNtPreRenameKey] = true;
+	return filter;
+}
+
+constexpr RegNotifyFilter g_RegNotifyFilter = _makeRegNotifyFilter();
+
+inline bool _isFilteredRegNotify(REG_NOTIFY_CLASS regNotify)
+{
+	if (ULONG(regNotify) >= ULONG(MaxRegNtNotifyClass)) {
+		return false;
+	}
+	return g_RegNotifyFilter.isFiltered[regNotify];
+}
+
+// per class: how many times the watched processes had to be looked up, and how many operations got blocked
+struct RegNotifyStats
+{
+	volatile LONG checked;
+	volatile LONG denied;
+};
+
+RegNotifyStats g_RegNotifyStats[MaxRegNtNotifyClass] = { 0 };
+
 NTSTATUS OnRegistryNotify(PVOID context, PVOID regNotifyClass, PVOID arg2)
 {
 	UNREFERENCED_PARAMETER(context);
 	UNREFERENCED_PARAMETER(arg2);
+
+	const REG_NOTIFY_CLASS regNotify = (REG_NOTIFY_CLASS)(ULONG_PTR)regNotifyClass;
+	if (!_isFilteredRegNotify(regNotify)) {
+		return STATUS_SUCCESS; //do not interfere
+	}
+	if (!Data::IsAnyTreeWatched()) {
+		return STATUS_SUCCESS; //nothing is watched, do not interfere
+	}
 	const ULONG sourcePID = HandleToULong(PsGetCurrentProcessId()); //the PID of the process performing the operation
-	if (!Data::ContainsProcess(sourcePID)) {
+	if (!Data::MayBeWatchedProcess(sourcePID)) {
 		return STATUS_SUCCESS; //do not interfere
 	}
-	const REG_NOTIFY_CLASS regNotify = (REG_NOTIFY_CLASS)(ULONG_PTR)regNotifyClass;
-	switch (regNotify) {
-		case RegNtPreCreateKey:
-		case RegNtSetValueKey:
-		case RegNtPreDeleteKey:
-		case RegNtPreRenameKey:
-			break;
-		default:
-			return STATUS_SUCCESS; //do not interfere
+	InterlockedIncrement(&g_RegNotifyStats[regNotify].checked);
+	if (!Data::ContainsProcess(sourcePID)) {
+		return STATUS_SUCCESS; //do not interfere
 	}
+	InterlockedIncrement(&g_RegNotifyStats[regNotify].denied);
 	DbgPrint(DRIVER_PREFIX "[%d] Process is trying to access registry key, notify type: [%d]\n", sourcePID, regNotify);
 	return STATUS_ACCESS_DENIED; //block the access
 }
+
+void DumpRegistryNotifyStats()
+{
+	for (ULONG i = 0; i < ULONG(MaxRegNtNotifyClass); i++) {
+		if (!g_RegNotifyStats[i].checked) continue;
+
+		DbgPrint(DRIVER_PREFIX "Registry notify type: [%d] checked: %d, denied: %d\n", i, g_RegNotifyStats[i].checked, g_RegNotifyStats[i].denied);
+	}
+}
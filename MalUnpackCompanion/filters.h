@@ -7,3 +7,6 @@
 OB_PREOP_CALLBACK_STATUS OnPreOpenProcess(PVOID RegistrationContext, POB_PRE_OPERATION_INFORMATION Info);
 
 NTSTATUS OnRegistryNotify(PVOID context, PVOID arg1, PVOID arg2);
+
+// prints how many registry operations of each type needed the lookup of the watched processes
+void DumpRegistryNotifyStats();
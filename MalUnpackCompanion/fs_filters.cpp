@@ -1,54 +1,29 @@
 #include "fs_filters.h"
 #include "file_util.h"
+#include "file_id_cache.h"
 
 namespace FltUtil {
 
-	NTSTATUS IsNonDefaultFileStream(PCFLT_RELATED_OBJECTS FltObjects, PFLT_CALLBACK_DATA Data, BOOLEAN& isNonDefault)
-	{
-		if (!Data || !FltObjects) {
-			return STATUS_INVALID_PARAMETER;
-		}
-		PFLT_FILE_NAME_INFORMATION pFileNameInfo = NULL;
-		NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &pFileNameInfo);
-		if (!NT_SUCCESS(status)) {
-			return status;
-		}
-		if (pFileNameInfo && pFileNameInfo->Stream.Length) {
-			isNonDefault = TRUE;
-		}
-		FltReleaseFileNameInformation(pFileNameInfo);
-		return status;
-	}
-
-	NTSTATUS GetFileId(PCFLT_RELATED_OBJECTS FltObjects, PFLT_CALLBACK_DATA Data, LONGLONG& FileId, char *caller)
+	void _LogNameQueryFailure(NTSTATUS status, char* caller)
 	{
 		UNREFERENCED_PARAMETER(caller);
 
-		FileId = FILE_INVALID_FILE_ID;
-
-		if (!Data || !FltObjects) {
-			return STATUS_INVALID_PARAMETER;
-		}
-		
-		PFLT_FILE_NAME_INFORMATION pFileNameInfo = NULL;
-		NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &pFileNameInfo);
-		if (!NT_SUCCESS(status)) {
-			if (status != STATUS_FLT_INVALID_NAME_REQUEST && 
-				status != STATUS_OBJECT_NAME_INVALID &&
-				status != STATUS_OBJECT_PATH_NOT_FOUND)
-			{
-				KdPrint((DRIVER_PREFIX "[!!!][%s] Failed to get filename information, status: %X\n", caller, status));
-			}
-			return status;
+		if (status != STATUS_FLT_INVALID_NAME_REQUEST &&
+			status != STATUS_OBJECT_NAME_INVALID &&
+			status != STATUS_OBJECT_PATH_NOT_FOUND)
+		{
+			KdPrint((DRIVER_PREFIX "[!!!][%s] Failed to get filename information, status: %X\n", caller, status));
 		}
+	}
 
-		PUNICODE_STRING FileName = &pFileNameInfo->Name;
+	// opens the existing file just for querying its attributes
+	NTSTATUS _OpenFileForQuery(PCFLT_RELATED_OBJECTS FltObjects, PUNICODE_STRING FileName, HANDLE& hFile)
+	{
 		OBJECT_ATTRIBUTES objAttr;
 		InitializeObjectAttributes(&objAttr, FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
 
-		HANDLE hFile;
 		IO_STATUS_BLOCK ioStatusBlock;
-		status = FltCreateFile(FltObjects->Filter,
+		return FltCreateFile(FltObjects->Filter,
 			FltObjects->Instance,
 			&hFile,
 			SYNCHRONIZE | FILE_READ_ATTRIBUTES,
@@ -63,74 +38,122 @@ namespace FltUtil {
 			0,
 			IO_IGNORE_SHARE_ACCESS_CHECK
 		);
+	}
+
+	NTSTATUS GetFileKey(PCFLT_RELATED_OBJECTS FltObjects, PFLT_CALLBACK_DATA Data, FileKey& Key, char *caller)
+	{
+		Key = FileKeys::invalidKey();
+
+		if (!Data || !FltObjects) {
+			return STATUS_INVALID_PARAMETER;
+		}
+		
+		PFLT_FILE_NAME_INFORMATION pFileNameInfo = NULL;
+		NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &pFileNameInfo);
+		if (!NT_SUCCESS(status)) {
+			_LogNameQueryFailure(status, caller);
+			return status;
+		}
+
+		PUNICODE_STRING FileName = &pFileNameInfo->Name;
+		if (FileIdCache::Lookup(FileName, Key)) {
+			FltReleaseFileNameInformation(pFileNameInfo);
+			return STATUS_SUCCESS;
+		}
+		const LONG cacheGeneration = FileIdCache::GetGeneration();
+
+		HANDLE hFile = NULL;
+		status = _OpenFileForQuery(FltObjects, FileName, hFile);
 		if (NT_SUCCESS(status)) {
-			status = FileUtil::FetchFileId(hFile, FileId);
+			status = FileUtil::FetchFileKey(hFile, Key);
 			FltClose(hFile);
 		}
+		if (NT_SUCCESS(status)) {
+			FileIdCache::Store(FileName, Key, cacheGeneration);
+		}
 		FltReleaseFileNameInformation(pFileNameInfo);
 		return status;
 	}
 
-	//WARNING: use it only after the object is verified, otherwise it can cause crash!
-	NTSTATUS FltGetFileSize(PCFLT_RELATED_OBJECTS FltObjects, LONGLONG& myFileSize)
+	// retrieves the key of the file that is already opened (FltObjects->FileObject), without reopening it by name
+	NTSTATUS GetOpenedFileKey(PCFLT_RELATED_OBJECTS FltObjects, FileKey& Key)
 	{
-		myFileSize = INVALID_FILE_SIZE;
-		if (!FltObjects) {
+		Key = FileKeys::invalidKey();
+
+		if (!FltObjects || !FltObjects->Instance || !FltObjects->FileObject) {
 			return STATUS_INVALID_PARAMETER;
 		}
-		LARGE_INTEGER fileSize;
-		NTSTATUS status = FsRtlGetFileSize(FltObjects->FileObject, &fileSize);
+		FILE_ID_INFORMATION fileIdInfo = { 0 };
+		NTSTATUS status = FltQueryInformationFile(FltObjects->Instance,
+			FltObjects->FileObject,
+			&fileIdInfo,
+			sizeof(fileIdInfo),
+			FileIdInformation,
+			NULL);
 		if (NT_SUCCESS(status)) {
-			myFileSize = fileSize.QuadPart;
+			Key = FileKeys::fromIdInfo(fileIdInfo);
+			return status;
 		}
-		return status;
+		// not supported by the filesystem: build the key from the 64-bit ID (the same way as FileUtil::FetchFileKey)
+		FILE_INTERNAL_INFORMATION internalInfo = { 0 };
+		status = FltQueryInformationFile(FltObjects->Instance,
+			FltObjects->FileObject,
+			&internalInfo,
+			sizeof(internalInfo),
+			FileInternalInformation,
+			NULL);
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+		// the label does not need to fit, only the serial number is used:
+		FILE_FS_VOLUME_INFORMATION volumeInfo = { 0 };
+		status = FltQueryVolumeInformationFile(FltObjects->Instance,
+			FltObjects->FileObject,
+			&volumeInfo,
+			sizeof(volumeInfo),
+			FileFsVolumeInformation,
+			NULL);
+		if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW) {
+			return status;
+		}
+		Key = FileKeys::fromIndexNumber(volumeInfo.VolumeSerialNumber, internalInfo.IndexNumber.QuadPart);
+		return STATUS_SUCCESS;
 	}
 
-	NTSTATUS GetFileSize(PCFLT_RELATED_OBJECTS FltObjects, PFLT_CALLBACK_DATA Data, LONGLONG& myFileSize)
+	// invalidates the cached ID of the file that is the target of the operation
+	void InvalidateCachedFileId(PFLT_CALLBACK_DATA Data)
 	{
-		myFileSize = INVALID_FILE_SIZE;
-		if (!Data || !FltObjects) {
-			return STATUS_INVALID_PARAMETER;
+		if (!Data) return;
+
+		// the IDs that are being fetched concurrently may be already stale:
+		FileIdCache::RejectPendingStores();
+		if (FileIdCache::IsEmpty()) {
+			return; // so, nothing stale could have been cached
 		}
 
 		PFLT_FILE_NAME_INFORMATION pFileNameInfo = NULL;
 		NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &pFileNameInfo);
 		if (!NT_SUCCESS(status)) {
-			if (status != STATUS_FLT_INVALID_NAME_REQUEST &&
-				status != STATUS_OBJECT_NAME_INVALID &&
-				status != STATUS_OBJECT_PATH_NOT_FOUND)
-			{
-				KdPrint((DRIVER_PREFIX __FUNCTION__ "[!!!] Failed to get filename information, status: %X\n", status));
-			}
-			return status;
+			// cannot tell which entry is affected, so drop all of them
+			FileIdCache::Flush();
+			return;
 		}
+		FileIdCache::Invalidate(&pFileNameInfo->Name);
+		FltReleaseFileNameInformation(pFileNameInfo);
+	}
 
-		PUNICODE_STRING FileName = &pFileNameInfo->Name;
-		OBJECT_ATTRIBUTES objAttr;
-		InitializeObjectAttributes(&objAttr, FileName, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
-
-		HANDLE hFile;
-		IO_STATUS_BLOCK ioStatusBlock;
-		status = FltCreateFile(FltObjects->Filter,
-			FltObjects->Instance,
-			&hFile,
-			SYNCHRONIZE | FILE_READ_ATTRIBUTES,
-			&objAttr,
-			&ioStatusBlock,
-			NULL,
-			FILE_ATTRIBUTE_NORMAL,
-			FILE_SHARE_READ,
-			FILE_OPEN,
-			FILE_SYNCHRONOUS_IO_NONALERT,
-			NULL,
-			0,
-			IO_IGNORE_SHARE_ACCESS_CHECK
-		);
+	//WARNING: use it only after the object is verified, otherwise it can cause crash!
+	NTSTATUS FltGetFileSize(PCFLT_RELATED_OBJECTS FltObjects, LONGLONG& myFileSize)
+	{
+		myFileSize = INVALID_FILE_SIZE;
+		if (!FltObjects) {
+			return STATUS_INVALID_PARAMETER;
+		}
+		LARGE_INTEGER fileSize;
+		NTSTATUS status = FsRtlGetFileSize(FltObjects->FileObject, &fileSize);
 		if (NT_SUCCESS(status)) {
-			status = FileUtil::FetchFileSize(hFile, myFileSize);
-			FltClose(hFile);
+			myFileSize = fileSize.QuadPart;
 		}
-		FltReleaseFileNameInformation(pFileNameInfo);
 		return status;
 	}
 
@@ -147,60 +170,131 @@ namespace FltUtil {
 		return false;
 	}
 
-	bool IsCreateOrOverwriteEmpty(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects)
+	// after these operations the file name may point to another file, so its cached ID must be invalidated in post
+	bool IsNameRemappingCreate(PFLT_CALLBACK_DATA Data)
 	{
-		if (!Data || !FltObjects) return false;
+		if (!Data) return false;
 
-		const auto& params = Data->Iopb->Parameters.Create;
+		const ULONG createDisposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0x000000FF;
+		return _IsAnyCreateOverwriteDisp(createDisposition);
+	}
 
-		const ULONG createDisposition = (params.Options >> 24) & 0x000000FF;
-		const bool isAnyCreate = _IsAnyCreateOverwriteDisp(createDisposition);
+	bool IsNameRemappingSetInfo(PFLT_CALLBACK_DATA Data)
+	{
+		if (!Data) return false;
+
+		switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+		case FileRenameInformation:
+		case FileRenameInformationEx:
+		case FileLinkInformation:
+		case FileLinkInformationEx:
+		case FileDispositionInformation:
+		case FileDispositionInformationEx:
+			return true;
+		}
+		return false;
+	}
 
-		// Retrieve file size:
-		LONGLONG FileSize = INVALID_FILE_SIZE;
-		const NTSTATUS fileSizeStatus = FltUtil::GetFileSize(FltObjects, Data, FileSize);
+	// Fetches all the information about the target of the create that the pre-create needs,
+	// querying the name once, and opening the existing file at most once.
+	void AnalyzeCreate(PCFLT_RELATED_OBJECTS FltObjects, PFLT_CALLBACK_DATA Data, CreateAnalysis& info)
+	{
+		info.isAnalyzed = true;
+		if (!Data || !FltObjects) {
+			info.fileIdStatus = info.fileSizeStatus = STATUS_INVALID_PARAMETER;
+			return;
+		}
 
-		if (fileSizeStatus == STATUS_OBJECT_NAME_NOT_FOUND || 
-			fileSizeStatus == STATUS_OBJECT_PATH_NOT_FOUND)
-		{
-			FileSize = 0; //name not found, it is a new file
+		PFLT_FILE_NAME_INFORMATION pFileNameInfo = NULL;
+		NTSTATUS status = FltGetFileNameInformation(Data, FLT_FILE_NAME_NORMALIZED | FLT_FILE_NAME_QUERY_DEFAULT, &pFileNameInfo);
+		if (!NT_SUCCESS(status)) {
+			_LogNameQueryFailure(status, __FUNCTION__);
+			info.fileIdStatus = info.fileSizeStatus = status;
+			return;
 		}
-		// Check if it is creating a new file or replacing empty:
-		if ((FILE_CREATE == createDisposition)
-			|| ((FileSize == 0) && isAnyCreate))
-		{
-			const ACCESS_MASK DesiredAccess = (params.SecurityContext != nullptr) ? params.SecurityContext->DesiredAccess : 0;
-			KdPrint((DRIVER_PREFIX __FUNCTION__ ": Requested creating new file, createDisposition %X, DesiredAccess %X, isAnyCreate: %X, fileSize: %llX\n",
-				createDisposition,
-				DesiredAccess,
-				isAnyCreate,
-				FileSize
-			));
-			return true;
+		info.isAltStream = (pFileNameInfo->Stream.Length != 0);
+
+		PUNICODE_STRING FileName = &pFileNameInfo->Name;
+		const bool isIdCached = FileIdCache::Lookup(FileName, info.fileKey);
+		if (isIdCached) {
+			info.fileIdStatus = STATUS_SUCCESS;
 		}
-		return false;
+		// the size of the existing file matters only if it may get replaced:
+		const bool isSizeNeeded = info.isAnyCreate && (info.createDisposition != FILE_CREATE);
+		if (!isIdCached || isSizeNeeded) {
+			const LONG cacheGeneration = FileIdCache::GetGeneration();
+			HANDLE hFile = NULL;
+			status = _OpenFileForQuery(FltObjects, FileName, hFile);
+			if (NT_SUCCESS(status)) {
+				if (!isIdCached) {
+					info.fileIdStatus = FileUtil::FetchFileKey(hFile, info.fileKey);
+					if (NT_SUCCESS(info.fileIdStatus)) {
+						FileIdCache::Store(FileName, info.fileKey, cacheGeneration);
+					}
+				}
+				if (isSizeNeeded) {
+					info.fileSizeStatus = FileUtil::FetchFileSize(hFile, info.fileSize);
+				}
+				FltClose(hFile);
+			}
+			else {
+				if (!isIdCached) {
+					info.fileIdStatus = status;
+				}
+				info.fileSizeStatus = status;
+			}
+		}
+		FltReleaseFileNameInformation(pFileNameInfo);
 	}
 }
 
+///
 
-bool _SetFileContext(PCFLT_RELATED_OBJECTS FltObjects, LONGLONG fileId, char* caller)
+void CreateAnalysis::init(PFLT_CALLBACK_DATA Data, ULONG pid)
+{
+	sourcePid = pid;
+	createDisposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0x000000FF;
+	isAnyCreate = FltUtil::_IsAnyCreateOverwriteDisp(createDisposition);
+	isAnalyzed = false;
+	isAltStream = false;
+	fileKey = FileKeys::invalidKey();
+	fileIdStatus = STATUS_UNSUCCESSFUL;
+	fileSize = INVALID_FILE_SIZE;
+	fileSizeStatus = STATUS_UNSUCCESSFUL;
+}
+
+bool CreateAnalysis::isCreateOrOverwriteEmpty() const
+{
+	LONGLONG size = fileSize;
+	if (fileSizeStatus == STATUS_OBJECT_NAME_NOT_FOUND ||
+		fileSizeStatus == STATUS_OBJECT_PATH_NOT_FOUND)
+	{
+		size = 0; //name not found, it is a new file
+	}
+	// Check if it is creating a new file or replacing empty:
+	return (FILE_CREATE == createDisposition) || ((size == 0) && isAnyCreate);
+}
+
+
+
+bool _SetFileContext(PCFLT_RELATED_OBJECTS FltObjects, const FileKey& fileKey, char* caller)
 {
 	FileContext* ctx = nullptr; //STATUS_FLT_CONTEXT_ALLOCATION_NOT_FOUND
 	NTSTATUS ctx_status = FltAllocateContext(FltObjects->Filter, FLT_FILE_CONTEXT, sizeof(FileContext), PagedPool, (PFLT_CONTEXT*)&ctx);
 	if (!NT_SUCCESS(ctx_status)) {
-		DbgPrint(DRIVER_PREFIX "[CTX][ERR][%s][% llX] Creating the context failed : % x\n", caller, fileId, ctx_status);
+		DbgPrint(DRIVER_PREFIX "[CTX][ERR][%s][" FILE_KEY_FMT "] Creating the context failed : % x\n", caller, FILE_KEY_ARGS(fileKey), ctx_status);
 		return false;
 	}
 	bool isSet = false;
-	ctx->fileId = fileId;
+	ctx->fileKey = fileKey;
 	ctx_status = FltSetFileContext(FltObjects->Instance, FltObjects->FileObject, FLT_SET_CONTEXT_KEEP_IF_EXISTS, ctx, nullptr);
 	if (NT_SUCCESS(ctx_status)) {
-		KdPrint((DRIVER_PREFIX "[CTX][OK][%s][%llX] Attached the context to the file\n", caller, fileId));
+		KdPrint((DRIVER_PREFIX "[CTX][OK][%s][" FILE_KEY_FMT "] Attached the context to the file\n", caller, FILE_KEY_ARGS(fileKey)));
 		isSet = true;
 	}
 	else {
 		if (ctx_status != STATUS_NOT_SUPPORTED && ctx_status != STATUS_FLT_CONTEXT_ALREADY_DEFINED) {
-			DbgPrint(DRIVER_PREFIX "[CTX][ERR][%s][% llX] Attaching the context failed : % x\n", caller, fileId, ctx_status);
+			DbgPrint(DRIVER_PREFIX "[CTX][ERR][%s][" FILE_KEY_FMT "] Attaching the context failed : % x\n", caller, FILE_KEY_ARGS(fileKey), ctx_status);
 		}
 	}
 	FltReleaseContext(ctx); ctx = nullptr;
@@ -208,23 +302,51 @@ bool _SetFileContext(PCFLT_RELATED_OBJECTS FltObjects, LONGLONG fileId, char* ca
 }
 
 
-LONGLONG _GetFileIdFromContext(PFLT_INSTANCE CONST Instance, PFILE_OBJECT CONST FileObject, char* caller)
+FileKey _GetFileKeyFromContext(PFLT_INSTANCE CONST Instance, PFILE_OBJECT CONST FileObject, char* caller)
 {
 	UNREFERENCED_PARAMETER(caller);
-	LONGLONG fileId = FILE_INVALID_FILE_ID;
+	FileKey fileKey = FileKeys::invalidKey();
 	FileContext* ctx = nullptr;
 	NTSTATUS ctx_status = FltGetFileContext(Instance, FileObject, (PFLT_CONTEXT*)&ctx);
 	if (NT_SUCCESS(ctx_status)) {
 		if (ctx) {
-			fileId = ctx->fileId;
-			KdPrint((DRIVER_PREFIX "[CTX][OK][%s] Retrieved fileID: %llX\n", caller, fileId));
+			fileKey = ctx->fileKey;
+			KdPrint((DRIVER_PREFIX "[CTX][OK][%s] Retrieved fileKey: " FILE_KEY_FMT "\n", caller, FILE_KEY_ARGS(fileKey)));
 		}
 		FltReleaseContext(ctx); ctx = nullptr;
 	}
 	else {
 		KdPrint((DRIVER_PREFIX "[CTX][ERR][%s] Couldn't get file context, status: %x\n", caller, ctx_status));
 	}
-	return fileId;
+	return fileKey;
+}
+
+bool _HasFileContext(PFLT_INSTANCE CONST Instance, PFILE_OBJECT CONST FileObject)
+{
+	FileContext* ctx = nullptr;
+	NTSTATUS ctx_status = FltGetFileContext(Instance, FileObject, (PFLT_CONTEXT*)&ctx);
+	if (!NT_SUCCESS(ctx_status)) {
+		return false;
+	}
+	if (ctx) {
+		FltReleaseContext(ctx); ctx = nullptr;
+	}
+	return true;
+}
+
+// attaches the context to the file if it is watched, so that its deletion gets noticed at cleanup
+void _MarkIfWatchedFile(PCFLT_RELATED_OBJECTS FltObjects, char* caller)
+{
+	if (_HasFileContext(FltObjects->Instance, FltObjects->FileObject)) {
+		return; // already marked
+	}
+	FileKey fileKey = FileKeys::invalidKey();
+	if (!NT_SUCCESS(FltUtil::GetOpenedFileKey(FltObjects, fileKey))) {
+		return;
+	}
+	if (Data::ContainsFile(fileKey)) {
+		_SetFileContext(FltObjects, fileKey, caller);
+	}
 }
 
 ///
@@ -232,69 +354,110 @@ LONGLONG _GetFileIdFromContext(PFLT_INSTANCE CONST Instance, PFILE_OBJECT CONST
 
 FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID* CompletionContext)
 {
-	UNREFERENCED_PARAMETER(CompletionContext);
+	*CompletionContext = nullptr;
+
+	if (!Data::IsAnyTreeWatched()) {
+		if (!FileIdCache::IsEmpty()) {
+			// the cached IDs are not kept up to date when idle (the cache is flushed again when the first tree gets watched)
+			FileIdCache::Flush();
+		}
+		return FLT_PREOP_SUCCESS_NO_CALLBACK; // nothing is watched, do not interfere
+	}
+	// if the operation may change the file that is under the name, the cached ID needs to be invalidated in post
+	// (even if nothing is cached yet: the lookups of the name running concurrently must not store the stale ID),
+	// and if the file is going to be deleted on close, it needs to be marked in post:
+	const bool isPostNeeded = FltUtil::IsNameRemappingCreate(Data) || (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE);
+	const FLT_PREOP_CALLBACK_STATUS passStatus = isPostNeeded ? FLT_PREOP_SUCCESS_WITH_CALLBACK : FLT_PREOP_SUCCESS_NO_CALLBACK;
 
 	if (Data->RequestorMode == KernelMode) {
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+		return passStatus;
 	}
 
 	auto& params = Data->Iopb->Parameters.Create;
 	// chceck if the caller insist if it must be a directory:
 	if (params.Options & FILE_DIRECTORY_FILE) {
-		return FLT_PREOP_SUCCESS_NO_CALLBACK; // do not interfere
+		return passStatus; // do not interfere
 	}
 
 	const ULONG sourcePID = HandleToULong(PsGetCurrentProcessId()); //the PID of the process performing the operation
 	const ACCESS_MASK DesiredAccess = (params.SecurityContext != nullptr) ? params.SecurityContext->DesiredAccess : 0;
 
+	// the target file needs to be analyzed upfront only if it is going to be executed:
+	CreateAnalysis analysis;
+	analysis.init(Data, sourcePID);
+	const bool isExecute = (DesiredAccess & FILE_EXECUTE) ? true : false;
+	if (!isExecute && !Data::MayBeWatchedProcess(sourcePID)) {
+		return passStatus; // not a watched process, and not executing a file: do not interfere
+	}
+	if (isExecute) {
+		FltUtil::AnalyzeCreate(FltObjects, Data, analysis);
+	}
+
+	CallerInfo caller;
+	Data::ClassifyCaller(sourcePID, analysis.fileKey, caller);
+
 	// block unrelated processes from respawning the malicious files:
-	if (DesiredAccess & FILE_EXECUTE) {
+	if (isExecute && caller.isFileWatched()) {
 		const PUNICODE_STRING fileName = (Data->Iopb->TargetFileObject) ? &Data->Iopb->TargetFileObject->FileName : nullptr;
-		LONGLONG fileId = FILE_INVALID_FILE_ID;
-		FltUtil::GetFileId(FltObjects, Data, fileId, __FUNCTION__);
-		if (Data::ContainsFile(fileId)) {
-			DbgPrint(DRIVER_PREFIX "[%d] Process is trying to open watchedfile for execute\n", sourcePID);
-			if (fileName) {
-				DbgPrint(DRIVER_PREFIX "[%llX] File Name: %wZ\n", fileId, fileName);
-			}
-			if (!Data::IsProcessInFileOwners(sourcePID, fileId)) {
-				Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-				DbgPrint(DRIVER_PREFIX " [%d] Could not run the watched file by a process that is not an owner\n", sourcePID);
-				return FLT_PREOP_COMPLETE;
-			}
+		DbgPrint(DRIVER_PREFIX "[%d] Process is trying to open watchedfile for execute\n", sourcePID);
+		if (fileName) {
+			DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "] File Name: %wZ\n", FILE_KEY_ARGS(analysis.fileKey), fileName);
+		}
+		if (!caller.isFileOwner) {
+			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+			DbgPrint(DRIVER_PREFIX " [%d] Could not run the watched file by a process that is not an owner\n", sourcePID);
+			return FLT_PREOP_COMPLETE;
 		}
 	}
 	// check if the process is watched:
-	if (!Data::ContainsProcess(sourcePID)) {
+	if (!caller.isWatched()) {
 		// not a watched process
-		return FLT_PREOP_SUCCESS_NO_CALLBACK; // not a watched process, do not interfere
+		return passStatus; // not a watched process, do not interfere
+	}
+
+	// Analyze the target (if not analyzed yet):
+	if (!analysis.isAnalyzed) {
+		FltUtil::AnalyzeCreate(FltObjects, Data, analysis);
 	}
+	const ULONG createDisposition = analysis.createDisposition;
 
 	// Check if it is creating a new file:
-	if (FltUtil::IsCreateOrOverwriteEmpty(Data, FltObjects)) {
-		BOOLEAN isAltStream = FALSE;
-		if (NT_SUCCESS(FltUtil::IsNonDefaultFileStream(FltObjects, Data, isAltStream)) && isAltStream) {
+	if (analysis.isCreateOrOverwriteEmpty()) {
+		KdPrint((DRIVER_PREFIX __FUNCTION__ ": Requested creating new file, createDisposition %X, DesiredAccess %X, isAnyCreate: %X, fileSize: %llX\n",
+			createDisposition,
+			DesiredAccess,
+			analysis.isAnyCreate,
+			analysis.fileSize
+		));
+		if (analysis.isAltStream) {
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			DbgPrint(DRIVER_PREFIX "[%d] WARNING: Creating Alternative Data Streams is forbidden\n", sourcePID);
 			return FLT_PREOP_COMPLETE;
 		}
 		// check if adding the file is possible:
-		if (!Data::CanAddFile(sourcePID)) {
+		if (!caller.canAddFile) {
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			KdPrint((DRIVER_PREFIX " [%d] Could not add to the files watchlist: limit exhausted\n", sourcePID));
 			return FLT_PREOP_COMPLETE;
 		}
+		// pass the analysis to the post-op, that is going to add the created file:
+		CreateAnalysis* postAnalysis = AllocBuffer<CreateAnalysis>(1, false);
+		if (!postAnalysis) {
+			// the created file could not be tracked, so do not let it be created
+			Data->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+			return FLT_PREOP_COMPLETE;
+		}
+		*postAnalysis = analysis;
+		*CompletionContext = postAnalysis;
 		return FLT_PREOP_SYNCHRONIZE; // sync with post-op
 	}
 
-	const ULONG createDisposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0x000000FF;
 	const ULONG all_write = FILE_WRITE_DATA | FILE_WRITE_ATTRIBUTES | FILE_WRITE_EA | FILE_APPEND_DATA;
+	const FileKey fileKey = analysis.fileKey;
+	const NTSTATUS fileIdStatus = analysis.fileIdStatus;
 
-	// Retrieve and check the file ID:
-	LONGLONG fileId = FILE_INVALID_FILE_ID;
-	NTSTATUS fileIdStatus = FltUtil::GetFileId(FltObjects, Data, fileId, __FUNCTION__);
 	//It is NOT a creation of new file, and cannot verify the file ID, so deny the access...
-	if (FILE_INVALID_FILE_ID == fileId) {
+	if (!FileKeys::isValid(fileKey)) {
 		if ((FILE_OPEN != createDisposition) || (DesiredAccess & all_write)) {
 
 			if (fileIdStatus == STATUS_OBJECT_NAME_NOT_FOUND) {
@@ -310,88 +473,103 @@ FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreCreate(PFLT_CALLBACK_DATA Data, PCFL
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			return FLT_PREOP_COMPLETE;
 		}
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+		return passStatus;
 	}
 
 	if (DesiredAccess & all_write) {
-		if (!Data::IsProcessInFileOwners(sourcePID, fileId)) {
+		if (!isExecute) {
+			// now the file ID is known, so check the ownership:
+			Data::ClassifyCaller(sourcePID, fileKey, caller);
+		}
+		if (!caller.isFileOwner) {
 			// this file does not belong to the current process, block the access:
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			return FLT_PREOP_COMPLETE;
 		}
 
-		DbgPrint(DRIVER_PREFIX __FUNCTION__": Attempted writing to the OWNED file, DesiredAccess: %X createDisposition: %X fileID: %zX\n",
+		DbgPrint(DRIVER_PREFIX __FUNCTION__": Attempted writing to the OWNED file, DesiredAccess: %X createDisposition: %X fileKey: " FILE_KEY_FMT "\n",
 			DesiredAccess,
 			createDisposition,
-			fileId);
+			FILE_KEY_ARGS(fileKey));
 	}
 
-	return FLT_PREOP_SUCCESS_NO_CALLBACK; // no need to execute post-callback
+	return passStatus; // the post-callback is needed only to keep the FileId cache up to date
 }
 
-FLT_POSTOP_CALLBACK_STATUS MyFilterProtectPostCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags)
+// assigns the file created by a watched process to its tree
+void _TrackCreatedFile(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, const CreateAnalysis& analysis)
 {
-	UNREFERENCED_PARAMETER(CompletionContext);
-
-	if (Flags & FLTFL_POST_OPERATION_DRAINING) {
-		return FLT_POSTOP_FINISHED_PROCESSING;
-	}
-
-	if (Data->RequestorMode == KernelMode) {
-		return FLT_POSTOP_FINISHED_PROCESSING;
-	}
 	if (!NT_SUCCESS(Data->IoStatus.Status)) {
-		// the operation has been rejected at pre-create level
-		return FLT_POSTOP_FINISHED_PROCESSING;
+		// the operation has been rejected
+		return;
 	}
-
-	auto& params = Data->Iopb->Parameters.Create;
-	if (params.Options & FILE_DIRECTORY_FILE) {
-		// this is a directory, do not interfere
-		return FLT_POSTOP_FINISHED_PROCESSING;
-	}
-
-	const ULONG sourcePID = HandleToULong(PsGetCurrentProcessId()); //the PID of the process performing the operation
-	if (!Data::ContainsProcess(sourcePID)) {
-		return FLT_POSTOP_FINISHED_PROCESSING; // not a watched process, do not interfere
+	const ULONG sourcePID = analysis.sourcePid;
+	CallerInfo caller;
+	Data::ClassifyCaller(sourcePID, FileKeys::invalidKey(), caller);
+	if (!caller.isWatched()) {
+		return; // the process is no longer watched
 	}
 
-	// Retrieve and check the file ID:
-	LONGLONG fileId = FILE_INVALID_FILE_ID;
-	NTSTATUS fileIdStatus = FltUtil::GetFileId(FltObjects, Data, fileId, __FUNCTION__);
-	if (FILE_INVALID_FILE_ID == fileId) {
+	// Retrieve and check the file ID (the file is already opened, so it can be queried directly):
+	FileKey fileKey = FileKeys::invalidKey();
+	NTSTATUS fileIdStatus = FltUtil::GetOpenedFileKey(FltObjects, fileKey);
+	if (!FileKeys::isValid(fileKey)) {
 		// this should never happend: case handled pre-create
-		return FLT_POSTOP_FINISHED_PROCESSING;
+		return;
 	}
 
 	if (Data->IoStatus.Information == FILE_CREATED ||
 		Data->IoStatus.Information == FILE_OVERWRITTEN ||
 		Data->IoStatus.Information == FILE_SUPERSEDED)
 	{
-		DbgPrint(DRIVER_PREFIX "[%d][%s] Creating a new OWNED fileID: %zX fileIdStatus: %X\n", sourcePID, __FUNCTION__, fileId, fileIdStatus);
+		DbgPrint(DRIVER_PREFIX "[%d][%s] Creating a new OWNED fileKey: " FILE_KEY_FMT " fileIdStatus: %X, previous size: %llX\n", sourcePID, __FUNCTION__, FILE_KEY_ARGS(fileKey), fileIdStatus, analysis.fileSize);
 		const PUNICODE_STRING fileName = (Data->Iopb->TargetFileObject) ? &Data->Iopb->TargetFileObject->FileName : nullptr;
 		if (fileName) {
-			DbgPrint(DRIVER_PREFIX "[%llX] file Name: %wZ\n", fileId, fileName);
+			DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "] file Name: %wZ\n", FILE_KEY_ARGS(fileKey), fileName);
 		}
 		// assign this file to the process that created it:
-		const t_add_status add_status =  Data::AddFile(fileId, sourcePID);
-		if (add_status == ADD_OK) {
-			_SetFileContext(FltObjects, fileId, __FUNCTION__);
+		const t_add_status add_status =  Data::AddFile(fileKey, sourcePID);
+		if (add_status == ADD_OK || add_status == ADD_ALREADY_EXIST) {
+			// keep the ID with the file, so that the further operations do not need to query it
+			_SetFileContext(FltObjects, fileKey, __FUNCTION__);
 		}
 		if (add_status == ADD_LIMIT_EXHAUSTED) {
-			DbgPrint(DRIVER_PREFIX "[%llX][%s] Could not add to the files watchlist: limit exhausted\n", fileId, __FUNCTION__);
+			DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "][%s] Could not add to the files watchlist: limit exhausted\n", FILE_KEY_ARGS(fileKey), __FUNCTION__);
 		}
 		if (add_status == ADD_FORBIDDEN) {
-			DbgPrint(DRIVER_PREFIX "[%llX][%s] Could not add to the file to watchlist: already associated with other process\n", fileId, __FUNCTION__);
+			DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "][%s] Could not add to the file to watchlist: already associated with other process\n", FILE_KEY_ARGS(fileKey), __FUNCTION__);
 		}
 		// cancel the open operation if the file was not added to the list
 		if (add_status != ADD_OK && add_status != ADD_ALREADY_EXIST) {
 			FltCancelFileOpen(FltObjects->Instance, FltObjects->FileObject);
 			Data->IoStatus.Status = STATUS_ACCESS_DENIED;
 			Data->IoStatus.Information = 0;
-			return FLT_POSTOP_FINISHED_PROCESSING;
 		}
 	}
+}
+
+FLT_POSTOP_CALLBACK_STATUS MyFilterProtectPostCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags)
+{
+	// set by the pre-create only if the file created by a watched process needs to be tracked:
+	CreateAnalysis* analysis = (CreateAnalysis*)CompletionContext;
+
+	if (!(Flags & FLTFL_POST_OPERATION_DRAINING)) {
+		if (NT_SUCCESS(Data->IoStatus.Status) &&
+			(Data->IoStatus.Information == FILE_CREATED || Data->IoStatus.Information == FILE_SUPERSEDED))
+		{
+			// the name points to a new file now:
+			FltUtil::InvalidateCachedFileId(Data);
+		}
+		if (analysis) {
+			_TrackCreatedFile(Data, FltObjects, *analysis);
+		}
+		if (NT_SUCCESS(Data->IoStatus.Status) && (Data->Iopb->Parameters.Create.Options & FILE_DELETE_ON_CLOSE)
+			&& Data::IsAnyTreeWatched())
+		{
+			_MarkIfWatchedFile(FltObjects, __FUNCTION__);
+		}
+	}
+	FreeBuffer<CreateAnalysis>(analysis);
 	return FLT_POSTOP_FINISHED_PROCESSING;
 }
 
@@ -399,57 +577,86 @@ FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreSetInformation(PFLT_CALLBACK_DATA Da
 {
 	UNREFERENCED_PARAMETER(FltObjects);
 
-	if (Data->RequestorMode == KernelMode) {
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+	if (!Data::IsAnyTreeWatched()) {
+		if (!FileIdCache::IsEmpty()) {
+			// the cached IDs are not kept up to date when idle (the cache is flushed again when the first tree gets watched)
+			FileIdCache::Flush();
+		}
+		return FLT_PREOP_SUCCESS_NO_CALLBACK; // nothing is watched, do not interfere
 	}
+	// if the operation may change the file that is under the name, the cached IDs need to be invalidated in post
+	// (even if nothing is cached yet: the lookups of the name running concurrently must not store the stale ID),
+	// synchronized, so that the post-operation is called at PASSIVE_LEVEL:
+	const FLT_PREOP_CALLBACK_STATUS passStatus = FltUtil::IsNameRemappingSetInfo(Data)
+		? FLT_PREOP_SYNCHRONIZE : FLT_PREOP_SUCCESS_NO_CALLBACK;
 
 	// check if it is a delete operation:
 	auto& params = Data->Iopb->Parameters.SetFileInformation;
 	if (params.FileInformationClass != FileDispositionInformation && params.FileInformationClass != FileDispositionInformationEx) {
 		// not a delete operation
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+		return passStatus;
 	}
 
 	FILE_DISPOSITION_INFORMATION* info = (FILE_DISPOSITION_INFORMATION*)params.InfoBuffer;
 	if (!info->DeleteFile) {
-		return FLT_PREOP_SUCCESS_NO_CALLBACK;
+		return passStatus;
 	}
 
+	// the file is going to be deleted by a process that is not watched: only make sure the deletion gets noticed at cleanup
+	if (Data->RequestorMode == KernelMode) {
+		_MarkIfWatchedFile(FltObjects, __FUNCTION__);
+		return passStatus;
+	}
 	// check if it is a watched process:
 	const ULONG sourcePID = HandleToULong(PsGetCurrentProcessId()); //the PID of the process performing the operation
-	if (!Data::ContainsProcess(sourcePID)) { 
-		return FLT_PREOP_SUCCESS_NO_CALLBACK; //do not interfere
+	if (!Data::MayBeWatchedProcess(sourcePID)) {
+		_MarkIfWatchedFile(FltObjects, __FUNCTION__);
+		return passStatus; //do not interfere
 	}
 
-	//get the File ID:
+	//get the File ID from the context (if already attached):
 	NTSTATUS fileIdStatus = 0;
-	LONGLONG fileId = _GetFileIdFromContext(FltObjects->Instance, FltObjects->FileObject,__FUNCTION__);
-	if (fileId == FILE_INVALID_FILE_ID) {
-		fileIdStatus = FltUtil::GetFileId(FltObjects, Data, fileId, __FUNCTION__);
+	FileKey fileKey = _GetFileKeyFromContext(FltObjects->Instance, FltObjects->FileObject,__FUNCTION__);
+
+	CallerInfo caller;
+	Data::ClassifyCaller(sourcePID, fileKey, caller);
+	if (!caller.isWatched()) {
+		_MarkIfWatchedFile(FltObjects, __FUNCTION__);
+		return passStatus; //do not interfere
+	}
+
+	const bool isMarked = FileKeys::isValid(fileKey);
+	if (!isMarked) {
+		fileIdStatus = FltUtil::GetOpenedFileKey(FltObjects, fileKey);
+		Data::ClassifyCaller(sourcePID, fileKey, caller);
 	}
 
 	const PUNICODE_STRING fileName = (Data->Iopb->TargetFileObject) ? &Data->Iopb->TargetFileObject->FileName : nullptr;
 
 	// check if the watched process is the ower of this file:
-	if (Data::IsProcessInFileOwners(sourcePID, fileId)) {
+	if (caller.isFileOwner) {
 		// report about the operation:
-		DbgPrint(DRIVER_PREFIX "[%d] Attempted setting delete disposition for the OWNED file, fileID: %llX status: %X\n",
+		DbgPrint(DRIVER_PREFIX "[%d] Attempted setting delete disposition for the OWNED file, fileKey: " FILE_KEY_FMT " status: %X\n",
 			sourcePID,
-			fileId,
+			FILE_KEY_ARGS(fileKey),
 			fileIdStatus);
 
 		if (fileName) {
-			DbgPrint(DRIVER_PREFIX "[%zX] file Name: %wZ \n", fileId, fileName);
+			DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "] file Name: %wZ \n", FILE_KEY_ARGS(fileKey), fileName);
+		}
+		if (!isMarked) {
+			// so that the deletion gets noticed at cleanup:
+			_SetFileContext(FltObjects, fileKey, __FUNCTION__);
 		}
-		return FLT_PREOP_SUCCESS_NO_CALLBACK; //do not interfere
+		return passStatus; //do not interfere
 	}
 
-	DbgPrint(DRIVER_PREFIX "[%d] Attempted setting delete disposition for the NOT-owned file, fileID: %llX status: %X -> ACCESS_DENIED\n",
+	DbgPrint(DRIVER_PREFIX "[%d] Attempted setting delete disposition for the NOT-owned file, fileKey: " FILE_KEY_FMT " status: %X -> ACCESS_DENIED\n",
 		sourcePID,
-		fileId,
+		FILE_KEY_ARGS(fileKey),
 		fileIdStatus);
 	if (fileName) {
-		DbgPrint(DRIVER_PREFIX "[%zX] file Name: %wZ \n", fileId, fileName);
+		DbgPrint(DRIVER_PREFIX "[" FILE_KEY_FMT "] file Name: %wZ \n", FILE_KEY_ARGS(fileKey), fileName);
 	}
 
 	// this file does not belong to the current process, block the access:
@@ -457,19 +664,49 @@ FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreSetInformation(PFLT_CALLBACK_DATA Da
 	return FLT_PREOP_COMPLETE; //finish processing
 }
 
+FLT_POSTOP_CALLBACK_STATUS MyFilterProtectPostSetInformation(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags)
+{
+	UNREFERENCED_PARAMETER(FltObjects);
+	UNREFERENCED_PARAMETER(CompletionContext);
+
+	if (Flags & FLTFL_POST_OPERATION_DRAINING) {
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+	if (!NT_SUCCESS(Data->IoStatus.Status)) {
+		return FLT_POSTOP_FINISHED_PROCESSING;
+	}
+
+	switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+	case FileDispositionInformation:
+	case FileDispositionInformationEx:
+		// the file is going to be deleted, and its name released:
+		FltUtil::InvalidateCachedFileId(Data);
+		break;
+	default:
+		// renamed or linked: the destination name, as well as the names of the children of a directory, are affected
+		FileIdCache::RejectPendingStores();
+		if (!FileIdCache::IsEmpty()) {
+			FileIdCache::Flush();
+		}
+		break;
+	}
+	return FLT_POSTOP_FINISHED_PROCESSING;
+}
+
 
 FLT_PREOP_CALLBACK_STATUS MyPreCleanup(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID*)
 {
+	UNREFERENCED_PARAMETER(Data);
+
 	PAGED_CODE();
 
-	ULONG fileOwner = 0;
-	LONGLONG fileId = FILE_INVALID_FILE_ID;
-	NTSTATUS fileIdStatus = FltUtil::GetFileId(FltObjects, Data, fileId, __FUNCTION__);
-	if (NT_SUCCESS(fileIdStatus)) {
-		fileOwner = Data::GetFileOwner(fileId);
-		if (fileOwner && fileId != FILE_INVALID_FILE_ID) {
-			_SetFileContext(FltObjects, fileId, __FUNCTION__);
-		}
+	if (!Data::IsAnyTreeWatched()) {
+		return FLT_PREOP_SUCCESS_NO_CALLBACK; // nothing is watched: no file can need the deletion
+	}
+	// only the watched files are marked with the context:
+	// in post-create (when created), or when they are requested to be deleted (by disposition, or on close)
+	if (!_HasFileContext(FltObjects->Instance, FltObjects->FileObject)) {
+		return FLT_PREOP_SUCCESS_NO_CALLBACK; // not our file, no need to check if it was deleted
 	}
 	return FLT_PREOP_SUCCESS_WITH_CALLBACK;
 }
@@ -502,11 +739,11 @@ FLT_POSTOP_CALLBACK_STATUS MyPostCleanup(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_
 		return FLT_POSTOP_FINISHED_PROCESSING;
 	}
 
-	LONGLONG fileId = _GetFileIdFromContext(FltObjects->Instance, FltObjects->FileObject, __FUNCTION__);
-	if (fileId != FILE_INVALID_FILE_ID) {
-		DbgPrint(DRIVER_PREFIX __FUNCTION__" >>> The watched file was deleted from the disk: %llx\n", fileId);
-		if (Data::DeleteFile(fileId)) {
-			DbgPrint(DRIVER_PREFIX __FUNCTION__" >>> DELETED from the watch list: %llx\n", fileId);
+	FileKey fileKey = _GetFileKeyFromContext(FltObjects->Instance, FltObjects->FileObject, __FUNCTION__);
+	if (FileKeys::isValid(fileKey)) {
+		DbgPrint(DRIVER_PREFIX __FUNCTION__" >>> The watched file was deleted from the disk: " FILE_KEY_FMT "\n", FILE_KEY_ARGS(fileKey));
+		if (Data::DeleteFile(fileKey)) {
+			DbgPrint(DRIVER_PREFIX __FUNCTION__" >>> DELETED from the watch list: " FILE_KEY_FMT "\n", FILE_KEY_ARGS(fileKey));
 		}
 	}
 	return FLT_POSTOP_FINISHED_PROCESSING;
@@ -529,6 +766,31 @@ MyFilterUnload(
 }
 
 
+inline bool _IsTypeInMask(ULONG mask, ULONG type)
+{
+	if (type >= (sizeof(mask) * 8)) {
+		return false;
+	}
+	return (mask & (1UL << type)) ? true : false;
+}
+
+bool _IsRemovableVolume(PFLT_VOLUME Volume)
+{
+	// the names do not need to fit: only the fixed part of the properties is used
+	// (the struct as the member, so that the buffer is aligned as the struct requires)
+	union {
+		FLT_VOLUME_PROPERTIES props;
+		UCHAR buffer[sizeof(FLT_VOLUME_PROPERTIES) + 128];
+	} volumeProps = { 0 };
+	PFLT_VOLUME_PROPERTIES props = &volumeProps.props;
+	ULONG retLen = 0;
+	NTSTATUS status = FltGetVolumeProperties(Volume, props, sizeof(volumeProps), &retLen);
+	if (!NT_SUCCESS(status) && status != STATUS_BUFFER_OVERFLOW) {
+		return false;
+	}
+	return (props->DeviceCharacteristics & (FILE_REMOVABLE_MEDIA | FILE_FLOPPY_DISKETTE | FILE_REMOTE_DEVICE)) ? true : false;
+}
+
 NTSTATUS
 MyFilterInstanceSetup(
 	_In_ PCFLT_RELATED_OBJECTS FltObjects,
@@ -537,14 +799,22 @@ MyFilterInstanceSetup(
 	_In_ FLT_FILESYSTEM_TYPE VolumeFilesystemType
 )
 {
-	UNREFERENCED_PARAMETER(FltObjects);
-	UNREFERENCED_PARAMETER(Flags);
-	UNREFERENCED_PARAMETER(VolumeDeviceType);
-	UNREFERENCED_PARAMETER(VolumeFilesystemType);
-
 	PAGED_CODE();
 
-	KdPrint((DRIVER_PREFIX "MyFilterInstanceSetup: Entered\n"));
+	KdPrint((DRIVER_PREFIX "MyFilterInstanceSetup: Entered, DeviceType: %X, FsType: %X, Flags: %X\n", VolumeDeviceType, VolumeFilesystemType, Flags));
+
+	if (Flags & FLTFL_INSTANCE_SETUP_MANUAL_ATTACHMENT) {
+		// explicitly requested (i.e. by "fltmc attach"), so always allowed
+		return STATUS_SUCCESS;
+	}
+	if (!_IsTypeInMask(g_Settings.attachDeviceTypes, VolumeDeviceType) ||
+		!_IsTypeInMask(g_Settings.attachFsTypes, VolumeFilesystemType))
+	{
+		return STATUS_FLT_DO_NOT_ATTACH;
+	}
+	if (!g_Settings.attachRemovable && _IsRemovableVolume(FltObjects->Volume)) {
+		return STATUS_FLT_DO_NOT_ATTACH;
+	}
 	return STATUS_SUCCESS;
 }
 
@@ -591,4 +861,6 @@ MyFilterInstanceTeardownComplete(
 	PAGED_CODE();
 
 	KdPrint((DRIVER_PREFIX "MyFilterInstanceTeardownComplete: Entered\n"));
+	// the names of the detached volume may get reused:
+	FileIdCache::Flush();
 }
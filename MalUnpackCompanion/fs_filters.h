@@ -11,7 +11,25 @@ extern active_settings g_Settings;
 
 struct FileContext
 {
-	LONGLONG fileId;
+	FileKey fileKey;
+};
+
+// The target of IRP_MJ_CREATE, analyzed once in pre-create, and passed to post-create as the CompletionContext
+struct CreateAnalysis
+{
+	ULONG sourcePid;
+	ULONG createDisposition;
+	bool isAnyCreate;
+	bool isAnalyzed;
+	bool isAltStream;
+	FileKey fileKey;
+	NTSTATUS fileIdStatus;
+	LONGLONG fileSize;
+	NTSTATUS fileSizeStatus;
+
+	void init(PFLT_CALLBACK_DATA Data, ULONG pid);
+
+	bool isCreateOrOverwriteEmpty() const;
 };
 
 CONST FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
@@ -24,6 +42,7 @@ FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreCreate(PFLT_CALLBACK_DATA Data, PCFL
 FLT_POSTOP_CALLBACK_STATUS MyFilterProtectPostCreate(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
 
 FLT_PREOP_CALLBACK_STATUS MyFilterProtectPreSetInformation(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID*);
+FLT_POSTOP_CALLBACK_STATUS MyFilterProtectPostSetInformation(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
 
 FLT_PREOP_CALLBACK_STATUS MyPreCleanup(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID*);
 FLT_POSTOP_CALLBACK_STATUS MyPostCleanup(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_OBJECTS FltObjects, PVOID CompletionContext, FLT_POST_OPERATION_FLAGS Flags);
@@ -31,7 +50,7 @@ FLT_POSTOP_CALLBACK_STATUS MyPostCleanup(PFLT_CALLBACK_DATA Data, PCFLT_RELATED_
 
 CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
 	{ IRP_MJ_CREATE, 0, MyFilterProtectPreCreate, MyFilterProtectPostCreate },
-	{ IRP_MJ_SET_INFORMATION, 0, MyFilterProtectPreSetInformation, nullptr },
+	{ IRP_MJ_SET_INFORMATION, 0, MyFilterProtectPreSetInformation, MyFilterProtectPostSetInformation },
 	{ IRP_MJ_CLEANUP, 0, MyPreCleanup, MyPostCleanup},
 	{ IRP_MJ_OPERATION_END }
 };
@@ -0,0 +1,50 @@
+#include "journal.h"
+#include "shared_section.h"
+
+namespace Journal {
+	SharedSection g_Section;
+	JournalProducer g_Producer = { 0 }; // writes through the view in the system space
+};
+
+bool Journal::Init()
+{
+	g_Section.init();
+	if (!g_Section.create(SIZE_T(JournalRing::sizeFor(JOURNAL_CAPACITY)))) {
+		return false;
+	}
+	JournalHeader* hdr = static_cast<JournalHeader*>(g_Section.getView());
+	if (!JournalRing::init(g_Producer, hdr, JOURNAL_CAPACITY)) {
+		Destroy();
+		return false;
+	}
+	return true;
+}
+
+void Journal::Destroy()
+{
+	g_Producer.hdr = NULL;
+	g_Section.destroy();
+}
+
+void Journal::Record(const NodeEvent& evt)
+{
+	if (!g_Producer.hdr) return;
+
+	LARGE_INTEGER now = { 0 };
+	KeQuerySystemTime(&now);
+
+	JournalRecord rec = { 0 };
+	rec.timestamp = now.QuadPart;
+	rec.type = evt.type;
+	rec.rootPid = evt.rootPid;
+	rec.pid = evt.pid;
+	rec.volumeSerial = evt.fileKey.VolumeSerial;
+	rec.fileIdLow = evt.fileKey.FileIdLow;
+	rec.fileIdHigh = evt.fileKey.FileIdHigh;
+	JournalRing::write(g_Producer, rec);
+}
+
+NTSTATUS Journal::MapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize)
+{
+	return g_Section.mapIntoCurrentProcess(baseAddress, viewSize);
+}
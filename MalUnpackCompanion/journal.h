@@ -0,0 +1,23 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "common.h"
+#include "journal_ring.h"
+
+#define JOURNAL_CAPACITY 8192 // in records, must be a power of 2
+
+// The journal of the changes of the watched trees, kept in a section that the client maps read-only.
+// So, the client can follow the history of each tree without any request per change.
+
+namespace Journal {
+
+    bool Init();
+
+    void Destroy();
+
+    // to be called serialized (by the lock of the data layer)
+    void Record(const NodeEvent& evt);
+
+    // maps the journal read-only into the current process
+    NTSTATUS MapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize);
+};
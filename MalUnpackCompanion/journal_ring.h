@@ -0,0 +1,157 @@
+#pragma once
+
+#include "shared_mem.h"
+
+// The journal of the changes of the watched trees: a ring of fixed-size records, in the memory shared with the client.
+// Portable (no OS headers required): included by the driver and by the client.
+// Single producer (the driver, serialized by the lock of the data layer), any number of lock-free consumers:
+// each consumer keeps its own sequence number and detects the records overwritten in the meantime.
+
+#define JOURNAL_MAGIC 0x4A4E554D // "MUNJ"
+#define JOURNAL_VERSION 1
+
+typedef enum {
+	JOURNAL_READ_OK = 0,
+	JOURNAL_READ_NOT_YET, // the record with this number was not written yet
+	JOURNAL_READ_OVERWRITTEN, // the consumer was too slow: the record was already replaced with a newer one
+} t_journal_read;
+
+struct JournalHeader {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int recordSize; // sizeof(JournalRecord)
+	unsigned int capacity; // in records, a power of 2
+	volatile unsigned long long writeSeq; // the number of the last published record (they are numbered from 1)
+	unsigned long long reserved[5]; // keeps the records aligned to the cache line
+};
+
+struct JournalRecord {
+	volatile unsigned long long seq; // the number of the record, written last (0: the record is being written)
+	long long timestamp; // system time, in 100-nanosecond intervals since 1601
+	unsigned int type; // t_node_event
+	unsigned int rootPid;
+	unsigned int pid;
+	unsigned int reserved;
+	unsigned long long volumeSerial; // the file events only: FileKey of the file
+	unsigned long long fileIdLow;
+	unsigned long long fileIdHigh;
+};
+
+// The state of the producer, kept in its private memory: the header only publishes a copy of it,
+// so the producer never reads back anything that a consumer could have modified in the shared memory.
+struct JournalProducer {
+	JournalHeader* hdr;
+	unsigned int capacity; // in records, a power of 2
+	unsigned long long writeSeq; // the number of the last written record
+};
+
+namespace JournalRing {
+
+	inline JournalRecord* records(JournalHeader* hdr)
+	{
+		return reinterpret_cast<JournalRecord*>(hdr + 1);
+	}
+
+	inline const JournalRecord* records(const JournalHeader* hdr)
+	{
+		return reinterpret_cast<const JournalRecord*>(hdr + 1);
+	}
+
+	inline unsigned long long sizeFor(unsigned int capacity)
+	{
+		return sizeof(JournalHeader) + (unsigned long long)capacity * sizeof(JournalRecord);
+	}
+
+	// producer: prepares the zeroed memory of (at least) sizeFor(capacity) bytes
+	inline bool init(JournalProducer& producer, JournalHeader* hdr, unsigned int capacity)
+	{
+		producer.hdr = nullptr;
+		if (!hdr || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+			return false;
+		}
+		producer.capacity = capacity;
+		producer.writeSeq = 0;
+		producer.hdr = hdr;
+
+		hdr->recordSize = sizeof(JournalRecord);
+		hdr->capacity = capacity;
+		hdr->writeSeq = 0;
+		hdr->version = JOURNAL_VERSION;
+		SHARED_FENCE();
+		hdr->magic = JOURNAL_MAGIC; // the last: the consumer may validate the ring as soon as it is set
+		return true;
+	}
+
+	// consumer: checks if the ring is compatible
+	inline bool isValid(const JournalHeader* hdr)
+	{
+		if (!hdr || hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION) {
+			return false;
+		}
+		return hdr->recordSize == sizeof(JournalRecord) && hdr->capacity && (hdr->capacity & (hdr->capacity - 1)) == 0;
+	}
+
+	// producer: the seq field of the given record is ignored, the next number is assigned
+	inline unsigned long long write(JournalProducer& producer, const JournalRecord& rec)
+	{
+		const unsigned long long seq = producer.writeSeq + 1;
+		JournalRecord& slot = records(producer.hdr)[(seq - 1) & (producer.capacity - 1)];
+
+		slot.seq = 0;
+		SHARED_FENCE();
+		slot.timestamp = rec.timestamp;
+		slot.type = rec.type;
+		slot.rootPid = rec.rootPid;
+		slot.pid = rec.pid;
+		slot.reserved = 0;
+		slot.volumeSerial = rec.volumeSerial;
+		slot.fileIdLow = rec.fileIdLow;
+		slot.fileIdHigh = rec.fileIdHigh;
+		SHARED_FENCE();
+		slot.seq = seq;
+		SHARED_FENCE();
+		producer.writeSeq = seq;
+		producer.hdr->writeSeq = seq;
+		return seq;
+	}
+
+	// consumer: the number of the oldest record that can still be read
+	inline unsigned long long oldestSeq(const JournalHeader* hdr)
+	{
+		const unsigned long long last = hdr->writeSeq;
+		return (last > hdr->capacity) ? (last - hdr->capacity + 1) : 1;
+	}
+
+	// consumer: copies the record of the given number (numbered from 1)
+	inline t_journal_read read(const JournalHeader* hdr, unsigned long long seq, JournalRecord& out)
+	{
+		const unsigned long long last = hdr->writeSeq;
+		SHARED_FENCE();
+		if (seq == 0 || seq > last) {
+			return JOURNAL_READ_NOT_YET;
+		}
+		if (last - seq >= hdr->capacity) {
+			return JOURNAL_READ_OVERWRITTEN;
+		}
+		const JournalRecord& slot = records(hdr)[(seq - 1) & (hdr->capacity - 1)];
+		if (slot.seq != seq) {
+			return JOURNAL_READ_OVERWRITTEN;
+		}
+		SHARED_FENCE();
+		out.timestamp = slot.timestamp;
+		out.type = slot.type;
+		out.rootPid = slot.rootPid;
+		out.pid = slot.pid;
+		out.reserved = slot.reserved;
+		out.volumeSerial = slot.volumeSerial;
+		out.fileIdLow = slot.fileIdLow;
+		out.fileIdHigh = slot.fileIdHigh;
+		SHARED_FENCE();
+		// if the producer started rewriting the slot in the meantime, the copy may be torn:
+		if (slot.seq != seq) {
+			return JOURNAL_READ_OVERWRITTEN;
+		}
+		out.seq = seq;
+		return JOURNAL_READ_OK;
+	}
+};
@@ -1,4 +1,4 @@
-#include "data_structs.h"
+#include "kernel_sync.h"
 
 
 void FastMutex::Init() {
@@ -15,6 +15,32 @@ void FastMutex::Unlock() {
 
 //---
 
+void PushLock::Init() {
+	FltInitializePushLock(&_lock);
+}
+
+void PushLock::Lock() {
+	KeEnterCriticalRegion();
+	FltAcquirePushLockExclusive(&_lock);
+}
+
+void PushLock::Unlock() {
+	FltReleasePushLock(&_lock);
+	KeLeaveCriticalRegion();
+}
+
+void PushLock::LockShared() {
+	KeEnterCriticalRegion();
+	FltAcquirePushLockShared(&_lock);
+}
+
+void PushLock::UnlockShared() {
+	FltReleasePushLock(&_lock);
+	KeLeaveCriticalRegion();
+}
+
+//---
+
 void Event::Init()
 {
 	KeInitializeEvent(&_event, NotificationEvent, FALSE);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <fltKernel.h>
+
+// The kernel locks, to be passed to the lockers and the structures from data_structs.h
+
+// Mutex:
+
+class FastMutex {
+public:
+	void Init();
+
+	void Lock();
+	void Unlock();
+
+private:
+	FAST_MUTEX _mutex;
+};
+
+// Reader/writer lock:
+
+class PushLock {
+public:
+	void Init();
+
+	// exclusive access:
+	void Lock();
+	void Unlock();
+
+	// shared access:
+	void LockShared();
+	void UnlockShared();
+
+private:
+	EX_PUSH_LOCK _lock;
+};
+
+//Event 
+
+class Event {
+public:
+	void Init();
+
+	NTSTATUS WaitForEventSet(PLARGE_INTEGER timeout);
+	LONG SetEvent();
+	LONG ResetEvent();
+
+private:
+	KEVENT _event;
+};
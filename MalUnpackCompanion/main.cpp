@@ -10,6 +10,11 @@
 #include "data_manager.h"
 #include "filters.h"
 #include "fs_filters.h"
+#include "file_id_cache.h"
+#include "node_events.h"
+#include "journal.h"
+#include "tree_export.h"
+#include "batch.h"
 
 #include "process_util.h"
 #include "file_util.h"
@@ -27,39 +32,25 @@
 active_settings g_Settings;
 //---
 
-bool _AddProcessToParent(ULONG PID, ULONG ParentPID)
-{
-	if (Data::ContainsProcess(ParentPID)) {
-		DbgPrint(DRIVER_PREFIX "[%d] created WATCHED process: [%d]\n", ParentPID, PID);
-		t_add_status aStat = Data::AddProcess(PID, ParentPID);
-		if (aStat == ADD_OK || aStat == ADD_ALREADY_EXIST) {
-			return true;
-		}
-		if (aStat == ADD_LIMIT_EXHAUSTED) {
-			DbgPrint(DRIVER_PREFIX "[%d] Could not add to the watchlist: limit exhausted\n", PID);
-		}
-	}
-	return false;
-}
-
 void _OnProcessCreation(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId, _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo)
 {
-	UNREFERENCED_PARAMETER(Process);
 	const ULONG PID = HandleToULong(ProcessId);
-
-	USHORT commandLineSize = 0;
-	if (CreateInfo->CommandLine) {
-		commandLineSize = CreateInfo->CommandLine->Length;
-	}
 	const ULONG ParentPID = HandleToULong(CreateInfo->ParentProcessId);
-	bool isAdded = _AddProcessToParent(PID, ParentPID);
-
 	const ULONG creatorPID = HandleToULong(PsGetCurrentProcessId()); //the PID creating the thread
-	if (!isAdded && (ParentPID != creatorPID)) {
-		isAdded = _AddProcessToParent(PID, creatorPID);
-	}
-	if (isAdded && commandLineSize) {
-		DbgPrint(DRIVER_PREFIX "Added: [%d] -> %S\n", PID, CreateInfo->CommandLine->Buffer);
+
+	ULONG ownerPID = 0;
+	const t_add_status aStat = Data::AddCreatedProcess(PID, ParentPID, creatorPID, PsGetProcessCreateTimeQuadPart(Process), ownerPID);
+	switch (aStat) {
+		case ADD_OK:
+		case ADD_ALREADY_EXIST:
+			DbgPrint(DRIVER_PREFIX "[%d] created WATCHED process: [%d] (parent: %d, tree: %d)\n", creatorPID, PID, ParentPID, ownerPID);
+			if (CreateInfo->CommandLine && CreateInfo->CommandLine->Length) {
+				DbgPrint(DRIVER_PREFIX "Added: [%d] -> %wZ\n", PID, CreateInfo->CommandLine);
+			}
+			break;
+		case ADD_LIMIT_EXHAUSTED:
+			DbgPrint(DRIVER_PREFIX "[%d] Could not add to the watchlist: limit exhausted\n", PID);
+			break;
 	}
 }
 
@@ -68,11 +59,16 @@ void _OnProcessExit(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId)
 	UNREFERENCED_PARAMETER(Process);
 
 	const ULONG PID = HandleToULong(ProcessId);
-	Data::WaitForProcessDeletion(PID, 0);
+	LARGE_INTEGER timeout = { 0 };
+	timeout.QuadPart = -10000000LL * LONGLONG(g_Settings.rootExitTimeout); // relative, in 100ns units
+	Data::WaitForProcessDeletion(PID, (g_Settings.rootExitTimeout) ? &timeout : NULL);
 }
 
 void OnProcessNotify(_Inout_ PEPROCESS Process, _In_ HANDLE ProcessId, _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo)
 {
+	if (!Data::IsAnyTreeWatched()) {
+		return; // nothing is watched: the process cannot be added to, nor removed from, any tree
+	}
 	if (CreateInfo) {
 		//process created:
 		_OnProcessCreation(Process, ProcessId, CreateInfo);
@@ -100,8 +96,6 @@ void _UnregisterCallbacks()
 
 void MyDriverUnload(_In_ PDRIVER_OBJECT DriverObject)
 {
-	Data::FreeGlobals();
-
 	//unregister the notification
 	if (g_Settings.hasProcessNotify) {
 		PsSetCreateProcessNotifyRoutineEx(OnProcessNotify, TRUE);
@@ -109,6 +103,14 @@ void MyDriverUnload(_In_ PDRIVER_OBJECT DriverObject)
 	}
 
 	_UnregisterCallbacks();
+	DumpRegistryNotifyStats();
+
+	// only now, when no callback can be running anymore, free what the callbacks (and the listener of the nodes) use:
+	Data::FreeGlobals();
+	NodeEvents::Destroy();
+	Journal::Destroy();
+	TreeExport::Destroy();
+	FileIdCache::Destroy();
 
 	if (g_Settings.hasLink) {
 		UNICODE_STRING symLink = RTL_CONSTANT_STRING(MY_DRIVER_LINK);
@@ -158,6 +160,19 @@ NTSTATUS HandleCreateClose(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 	return openStatus;
 }
 
+NTSTATUS HandleCleanup(PDEVICE_OBJECT DeviceObject, PIRP Irp)
+{
+	UNREFERENCED_PARAMETER(DeviceObject);
+
+	// the handle is being closed, so nobody is going to collect the events requested with it:
+	NodeEvents::CancelPending(IoGetCurrentIrpStackLocation(Irp)->FileObject);
+
+	Irp->IoStatus.Status = STATUS_SUCCESS;
+	Irp->IoStatus.Information = 0;
+	IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	return STATUS_SUCCESS;
+}
+
 NTSTATUS FetchInputBufferOfMinSize(IN PIRP Irp, OUT void** inpData, IN const size_t inpDataSize, OUT OPTIONAL size_t *actualSize = nullptr)
 {
 	if (!Irp || inpData == nullptr) {
@@ -205,10 +220,42 @@ NTSTATUS FetchInputBuffer(PIRP Irp, DATA_BUF** inpData)
 }
 
 //---
+
+// The client passes just the 64-bit ID of the image file, that is unique only within its volume:
+// qualify it with the volume of the process image. Only the ID of the image itself can be qualified this way,
+// any other one may belong to a file on another volume - so it is rejected, rather than guessed.
+bool _QualifyImageFileId(PEPROCESS Process, LONGLONG imgFileId, FileKey& imgKey)
+{
+	imgKey = FileKeys::invalidKey();
+	if (FILE_INVALID_FILE_ID == imgFileId) {
+		return true; // nothing to protect
+	}
+	PUNICODE_STRING imageName = NULL;
+	NTSTATUS status = SeLocateProcessImageName(Process, &imageName);
+	if (!NT_SUCCESS(status) || !imageName) {
+		DbgPrint(DRIVER_PREFIX ": Could not retrieve the image of the process, status: %X\n", status);
+		return true;
+	}
+	// the client knows the 64-bit ID (nFileIndex), that is not always the low half of the 128-bit one (e.g. on ReFS):
+	// compare it with the same ID of the image, and then use the full key of the image
+	LONGLONG imgIndexNumber = FILE_INVALID_FILE_ID;
+	const FileKey foundKey = FileUtil::GetFileKeyByPath(imageName, &imgIndexNumber);
+	ExFreePool(imageName);
+	if (!FileKeys::isValid(foundKey)) {
+		return true;
+	}
+	if (imgIndexNumber != imgFileId) {
+		DbgPrint(DRIVER_PREFIX ": The passed file ID: %llX is not the ID of the image: %llX (" FILE_KEY_FMT "), cannot tell its volume\n",
+			imgFileId, imgIndexNumber, FILE_KEY_ARGS(foundKey));
+		return false;
+	}
+	imgKey = foundKey;
+	return true;
+}
+
 t_add_status _AddProcessWatch(ProcessDataEx &settings)
 {
 	const ULONG PID = settings.Pid;
-	const LONGLONG FileId = settings.fileId;
 
 	PEPROCESS Process;
 	NTSTATUS status = PsLookupProcessByProcessId(ULongToHandle(PID), &Process);
@@ -216,14 +263,24 @@ t_add_status _AddProcessWatch(ProcessDataEx &settings)
 		DbgPrint(DRIVER_PREFIX ": Such process does not exist: %d\n", PID);
 		return t_add_status::ADD_INVALID_ITEM;
 	}
+	FileKey imgKey = FileKeys::invalidKey();
+	const bool isQualified = _QualifyImageFileId(Process, settings.fileId, imgKey);
 
 	ObDereferenceObject(Process);
+	if (!isQualified) {
+		return t_add_status::ADD_INVALID_ITEM;
+	}
 
 	DbgPrint(DRIVER_PREFIX ": Watching process requested %d, noresp=%d\n", PID, settings.noresp);
-	t_add_status add_status = Data::AddProcessNode(PID, FileId, settings.noresp);
-	if (status == ADD_OK && FileId != FILE_INVALID_FILE_ID) {
-		if (Data::AddFile(FileId, PID) == ADD_OK) {
-			DbgPrint(DRIVER_PREFIX ": Watching process file %llx\n", FileId);
+	const bool wasIdle = !Data::IsAnyTreeWatched();
+	t_add_status add_status = Data::AddProcessNode(PID, imgKey, settings.noresp);
+	if (add_status == ADD_OK && wasIdle) {
+		// the name-remapping operations were not followed when idle: drop the cached IDs, and make the stores in progress fail
+		FileIdCache::Flush();
+	}
+	if (status == ADD_OK && FileKeys::isValid(imgKey)) {
+		if (Data::AddFile(imgKey, PID) == ADD_OK) {
+			DbgPrint(DRIVER_PREFIX ": Watching process file " FILE_KEY_FMT "\n", FILE_KEY_ARGS(imgKey));
 		}
 	}
 	return add_status;
@@ -329,18 +386,22 @@ NTSTATUS TerminateWatched(PIRP Irp)
 #define _TREAT_RENAMED_AS_DELETED
 NTSTATUS _DeleteWatchedFile(ULONG PID, PUNICODE_STRING FileName)
 {
-	LONGLONG fileId = FileUtil::GetFileIdByPath(FileName);
-	const ULONG fileOwnerPid = Data::GetFileOwner(fileId);
+	const FileKey fileKey = FileUtil::GetFileKeyByPath(FileName);
+	const ULONG fileOwnerPid = Data::GetFileOwner(fileKey);
 	if (fileOwnerPid != PID) {
-		DbgPrint(DRIVER_PREFIX __FUNCTION__ "FileID = %llx, PID = %d, fileOwnerPid = %d - owner mismatch!\n", fileId, PID, fileOwnerPid);
+		DbgPrint(DRIVER_PREFIX __FUNCTION__ "FileKey = " FILE_KEY_FMT ", PID = %d, fileOwnerPid = %d - owner mismatch!\n", FILE_KEY_ARGS(fileKey), PID, fileOwnerPid);
 		return STATUS_ACCESS_DENIED;
 	}
 	NTSTATUS status = FileUtil::RequestFileDeletion(FileName);
-	DbgPrint(DRIVER_PREFIX __FUNCTION__ "FileID = %llx, PID = %d, status = %X\n", fileId, PID, status);
+	DbgPrint(DRIVER_PREFIX __FUNCTION__ "FileKey = " FILE_KEY_FMT ", PID = %d, status = %X\n", FILE_KEY_ARGS(fileKey), PID, status);
+	if (NT_SUCCESS(status)) {
+		// the file is gone, no need to wait for the cleanup to notice it:
+		Data::DeleteFile(fileKey);
+	}
 #ifdef _TREAT_RENAMED_AS_DELETED
 	if (status == STATUS_CANNOT_DELETE) {
 		if (Util::hasSuffix(FileName, RENAMED_EXTENSION)) {
-			if (Data::DeleteFile(fileId)) {
+			if (Data::DeleteFile(fileKey)) {
 				status = STATUS_SUCCESS;
 			}
 		}
@@ -371,7 +432,24 @@ NTSTATUS DeleteWatchedFile(PIRP Irp)
 	return _DeleteWatchedFile(inpData->Pid, &name);
 }
 
-NTSTATUS _CopyWatchedList(PIRP Irp, ULONG_PTR& outLen, bool files)
+typedef enum {
+	LIST_PROCESSES = 0,
+	LIST_FILE_IDS,
+	LIST_FILE_KEYS
+} t_list_type;
+
+size_t _ListElementSize(t_list_type listType)
+{
+	switch (listType) {
+	case LIST_FILE_IDS:
+		return sizeof(LONGLONG);
+	case LIST_FILE_KEYS:
+		return sizeof(FileKey);
+	}
+	return sizeof(ULONG);
+}
+
+NTSTATUS _CopyWatchedList(PIRP Irp, ULONG_PTR& outLen, t_list_type listType)
 {
 	ProcessDataBasic* inpData = nullptr;
 	NTSTATUS status = FetchInputBuffer(Irp, &inpData);
@@ -379,7 +457,7 @@ NTSTATUS _CopyWatchedList(PIRP Irp, ULONG_PTR& outLen, bool files)
 		return status;
 	}
 	
-	const size_t elementSize = files ? sizeof(LONGLONG) : sizeof(ULONG);
+	const size_t elementSize = _ListElementSize(listType);
 
 	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
 	const size_t outBufSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
@@ -392,11 +470,16 @@ NTSTATUS _CopyWatchedList(PIRP Irp, ULONG_PTR& outLen, bool files)
 	}
 	ULONG parentPid = inpData->Pid;
 	size_t items = 0;
-	if (files) {
+	switch (listType) {
+	case LIST_FILE_IDS:
+		items = Data::CopyFileIdsList(parentPid, outData, outBufSize);
+		break;
+	case LIST_FILE_KEYS:
 		items = Data::CopyFilesList(parentPid, outData, outBufSize);
-	}
-	else {
+		break;
+	default:
 		items = Data::CopyProcessList(parentPid, outData, outBufSize);
+		break;
 	}
 	if (items > 0) {
 		KdPrint((DRIVER_PREFIX "Copied items to system buffer: %d\n", items));
@@ -408,12 +491,61 @@ NTSTATUS _CopyWatchedList(PIRP Irp, ULONG_PTR& outLen, bool files)
 
 NTSTATUS CopyProcessesList(PIRP Irp, ULONG_PTR& outLen)
 {
-	return _CopyWatchedList(Irp, outLen, false);
+	return _CopyWatchedList(Irp, outLen, LIST_PROCESSES);
 }
 
 NTSTATUS CopyFilesList(PIRP Irp, ULONG_PTR& outLen)
 {
-	return _CopyWatchedList(Irp, outLen, true);
+	return _CopyWatchedList(Irp, outLen, LIST_FILE_IDS);
+}
+
+NTSTATUS CopyFileKeysList(PIRP Irp, ULONG_PTR& outLen)
+{
+	return _CopyWatchedList(Irp, outLen, LIST_FILE_KEYS);
+}
+
+NTSTATUS _CopyWatchedPage(PIRP Irp, ULONG_PTR& outLen, t_list_type listType)
+{
+	ListPageRequest* inpData = nullptr;
+	NTSTATUS status = FetchInputBuffer(Irp, &inpData);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	const ULONG rootPid = inpData->Pid;
+	const ULONG cursor = inpData->cursor; // the input and output share the system buffer
+
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+	const size_t outBufSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
+	// the page must fit at least one item: otherwise an empty page could not be told from the last one
+	if (outBufSize < sizeof(ListPageHeader) + _ListElementSize(listType)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	UCHAR* outData = static_cast<UCHAR*>(Irp->AssociatedIrp.SystemBuffer);
+	if (outData == nullptr) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	ListPageHeader header = { 0 };
+	void* pageData = outData + sizeof(ListPageHeader);
+	const size_t pageSize = outBufSize - sizeof(ListPageHeader);
+	const bool isFound = (listType == LIST_FILE_KEYS)
+		? Data::CopyFilesPage(rootPid, cursor, header, pageData, pageSize)
+		: Data::CopyProcessPage(rootPid, cursor, header, pageData, pageSize);
+	if (!isFound) {
+		return STATUS_NOT_FOUND; // no tree with such root
+	}
+	::memcpy(outData, &header, sizeof(header));
+	outLen = sizeof(header) + header.itemCount * _ListElementSize(listType);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS CopyProcessesPage(PIRP Irp, ULONG_PTR& outLen)
+{
+	return _CopyWatchedPage(Irp, outLen, LIST_PROCESSES);
+}
+
+NTSTATUS CopyFilesPage(PIRP Irp, ULONG_PTR& outLen)
+{
+	return _CopyWatchedPage(Irp, outLen, LIST_FILE_KEYS);
 }
 
 NTSTATUS FetchDriverVersion(PIRP Irp, ULONG_PTR &outLen)
@@ -453,13 +585,55 @@ NTSTATUS CountNodes(PIRP Irp, ULONG_PTR& outLen)
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS HandleDeviceControl(PDEVICE_OBJECT, PIRP Irp)
+typedef enum {
+	SHARED_JOURNAL = 0,
+	SHARED_TREES
+} t_shared_type;
+
+NTSTATUS _MapShared(PIRP Irp, ULONG_PTR& outLen, t_shared_type sharedType)
 {
+	// the view is mapped into the process that sent the request:
+	if (Irp->RequestorMode != UserMode) {
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
 	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
-	
-	NTSTATUS status = STATUS_SUCCESS;
+	const size_t outBufSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outBufSize < sizeof(SharedMapping)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	void* outBuf = Irp->AssociatedIrp.SystemBuffer;
+	if (outBuf == nullptr) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	SharedMapping mapping = { 0 };
+	NTSTATUS status = (sharedType == SHARED_TREES)
+		? TreeExport::MapIntoCurrentProcess(mapping.baseAddress, mapping.viewSize)
+		: Journal::MapIntoCurrentProcess(mapping.baseAddress, mapping.viewSize);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	::memcpy(outBuf, &mapping, sizeof(mapping));
+	outLen = sizeof(mapping);
+	return STATUS_SUCCESS;
+}
 
-	ULONG_PTR outLen = 0;
+NTSTATUS MapJournal(PIRP Irp, ULONG_PTR& outLen)
+{
+	return _MapShared(Irp, outLen, SHARED_JOURNAL);
+}
+
+NTSTATUS MapTrees(PIRP Irp, ULONG_PTR& outLen)
+{
+	return _MapShared(Irp, outLen, SHARED_TREES);
+}
+
+NTSTATUS RunBatch(PIRP Irp, ULONG_PTR& outLen);
+
+NTSTATUS _DispatchControl(PIRP Irp, ULONG_PTR& outLen)
+{
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+	NTSTATUS status = STATUS_SUCCESS;
 	switch (stack->Parameters.DeviceIoControl.IoControlCode) {
 		case IOCTL_MUNPACK_COMPANION_VERSION:
 		{
@@ -503,10 +677,169 @@ NTSTATUS HandleDeviceControl(PDEVICE_OBJECT, PIRP Irp)
 			status = CopyFilesList(Irp, outLen);
 			break;
 		}
+		case IOCTL_MUNPACK_COMPANION_LIST_FILE_KEYS:
+		{
+			status = CopyFileKeysList(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_WAIT_NODE_EVENT:
+		{
+			status = NodeEvents::WaitForEvent(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_MAP_JOURNAL:
+		{
+			status = MapJournal(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_MAP_TREES:
+		{
+			status = MapTrees(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_LIST_PROCESSES_PAGED:
+		{
+			status = CopyProcessesPage(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_LIST_FILES_PAGED:
+		{
+			status = CopyFilesPage(Irp, outLen);
+			break;
+		}
+		case IOCTL_MUNPACK_COMPANION_BATCH:
+		{
+			status = RunBatch(Irp, outLen);
+			break;
+		}
 		default:
 			status = STATUS_INVALID_DEVICE_REQUEST;
 			break;
 	}
+	return status;
+}
+
+// runs the command of the batch with the handler of the single request:
+// the scratch IRP (never sent to any driver) carries its buffer in the same way as a buffered request
+NTSTATUS _RunBatchCommand(PIRP subIrp, const BatchCommand& cmd, const UCHAR* input, UCHAR* buffer, BatchResult& result)
+{
+	result.capacity = cmd.outputSize;
+	result.outputSize = 0;
+	switch (cmd.ioctl) {
+		case IOCTL_MUNPACK_COMPANION_BATCH:
+		case IOCTL_MUNPACK_COMPANION_WAIT_NODE_EVENT: // can't be pending within the batch
+			result.status = STATUS_INVALID_DEVICE_REQUEST;
+			return result.status;
+	}
+	if (IO_METHOD_FROM_CTL_CODE(cmd.ioctl) != METHOD_BUFFERED) {
+		result.status = STATUS_NOT_SUPPORTED;
+		return result.status;
+	}
+	if (cmd.inputSize) {
+		::memcpy(buffer, input, cmd.inputSize);
+	}
+	PIO_STACK_LOCATION subStack = IoGetCurrentIrpStackLocation(subIrp);
+	subStack->Parameters.DeviceIoControl.IoControlCode = cmd.ioctl;
+	subStack->Parameters.DeviceIoControl.InputBufferLength = cmd.inputSize;
+	subStack->Parameters.DeviceIoControl.OutputBufferLength = cmd.outputSize;
+	subIrp->AssociatedIrp.SystemBuffer = (cmd.inputSize || cmd.outputSize) ? buffer : NULL;
+
+	ULONG_PTR subOutLen = 0;
+	result.status = _DispatchControl(subIrp, subOutLen);
+	result.outputSize = ULONG((subOutLen > cmd.outputSize) ? cmd.outputSize : subOutLen);
+	return result.status;
+}
+
+// batchBuf: the copy of the input, parsed while the output is written into the system buffer
+NTSTATUS _RunBatchCommands(PIRP Irp, const UCHAR* batchBuf, size_t batchSize, ULONG_PTR& outLen)
+{
+	unsigned long long resultsSize = 0;
+	unsigned long long maxCommandBuffer = 0;
+	if (!Batch::measure(batchBuf, batchSize, resultsSize, maxCommandBuffer)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+	const size_t outBufSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outBufSize < resultsSize) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	UCHAR* cmdBuf = NULL;
+	if (maxCommandBuffer) {
+		cmdBuf = AllocBuffer<UCHAR>(size_t(maxCommandBuffer), false);
+		if (!cmdBuf) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+	PIRP subIrp = IoAllocateIrp(1, FALSE);
+	if (!subIrp) {
+		FreeBuffer<UCHAR>(cmdBuf);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	IoSetNextIrpStackLocation(subIrp);
+	subIrp->RequestorMode = Irp->RequestorMode;
+	PIO_STACK_LOCATION subStack = IoGetCurrentIrpStackLocation(subIrp);
+	subStack->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+	subStack->FileObject = stack->FileObject;
+
+	BatchHeader hdr = { 0 };
+	BatchCursor cursor = { 0 };
+	Batch::begin(batchBuf, batchSize, hdr, cursor);
+
+	UCHAR* outBuf = static_cast<UCHAR*>(Irp->AssociatedIrp.SystemBuffer);
+	::memset(outBuf, 0, size_t(resultsSize));
+	size_t outOffset = sizeof(BatchHeader);
+	BatchHeader outHdr = { 0, hdr.flags };
+
+	BatchCommand cmd = { 0 };
+	const UCHAR* input = NULL;
+	while (Batch::next(cursor, cmd, input) == BATCH_PARSE_OK) {
+		BatchResult result = { 0 };
+		const NTSTATUS cmdStatus = _RunBatchCommand(subIrp, cmd, input, cmdBuf, result);
+		::memcpy(outBuf + outOffset, &result, sizeof(result));
+		if (result.outputSize) {
+			::memcpy(outBuf + outOffset + sizeof(result), cmdBuf, result.outputSize);
+		}
+		outOffset += sizeof(result) + size_t(Batch::alignUp(cmd.outputSize));
+		outHdr.count++;
+		if (!NT_SUCCESS(cmdStatus) && (hdr.flags & BATCH_STOP_ON_ERROR)) {
+			break;
+		}
+	}
+	::memcpy(outBuf, &outHdr, sizeof(outHdr));
+	outLen = ULONG_PTR(resultsSize);
+
+	IoFreeIrp(subIrp);
+	FreeBuffer<UCHAR>(cmdBuf);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS RunBatch(PIRP Irp, ULONG_PTR& outLen)
+{
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+	const size_t inpBufSize = stack->Parameters.DeviceIoControl.InputBufferLength;
+	const UCHAR* inpBuf = static_cast<const UCHAR*>(Irp->AssociatedIrp.SystemBuffer);
+	if (!inpBuf || inpBufSize < sizeof(BatchHeader) || inpBufSize > BATCH_MAX_INPUT) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	// the input is going to be overwritten by the output (they share the system buffer), so parse its copy:
+	UCHAR* batchBuf = AllocBuffer<UCHAR>(inpBufSize, false);
+	if (!batchBuf) {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	::memcpy(batchBuf, inpBuf, inpBufSize);
+	const NTSTATUS status = _RunBatchCommands(Irp, batchBuf, inpBufSize, outLen);
+	FreeBuffer<UCHAR>(batchBuf);
+	return status;
+}
+
+NTSTATUS HandleDeviceControl(PDEVICE_OBJECT, PIRP Irp)
+{
+	ULONG_PTR outLen = 0;
+	const NTSTATUS status = _DispatchControl(Irp, outLen);
+	if (status == STATUS_PENDING) {
+		// queued: will be completed when the event arrives (or cancelled)
+		return status;
+	}
 
 	Irp->IoStatus.Status = status;
 	Irp->IoStatus.Information = outLen;
@@ -565,6 +898,52 @@ NTSTATUS RegisterCallbacks(_In_ PDRIVER_OBJECT DriverObject)
 	return status;
 }
 
+bool _QueryRegistryDword(HANDLE hKey, PCWSTR valueName, ULONG& value)
+{
+	UNICODE_STRING name;
+	RtlInitUnicodeString(&name, valueName);
+
+	UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)] = { 0 };
+	PKEY_VALUE_PARTIAL_INFORMATION info = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+	ULONG resultLen = 0;
+	NTSTATUS status = ZwQueryValueKey(hKey, &name, KeyValuePartialInformation, info, sizeof(buffer), &resultLen);
+	if (!NT_SUCCESS(status) || info->Type != REG_DWORD || info->DataLength != sizeof(ULONG)) {
+		return false;
+	}
+	value = *(ULONG*)info->Data;
+	return true;
+}
+
+// reads the settings from the service key (if not set, the defaults are used)
+void _LoadSettings(_In_ PUNICODE_STRING RegistryPath)
+{
+	if (!RegistryPath) return;
+
+	OBJECT_ATTRIBUTES objAttr;
+	InitializeObjectAttributes(&objAttr, RegistryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+	HANDLE hKey = NULL;
+	if (!NT_SUCCESS(ZwOpenKey(&hKey, KEY_READ, &objAttr))) {
+		return;
+	}
+	ULONG value = 0;
+	if (_QueryRegistryDword(hKey, L"AttachFsTypes", value)) {
+		g_Settings.attachFsTypes = value;
+	}
+	if (_QueryRegistryDword(hKey, L"AttachDeviceTypes", value)) {
+		g_Settings.attachDeviceTypes = value;
+	}
+	if (_QueryRegistryDword(hKey, L"AttachRemovableMedia", value)) {
+		g_Settings.attachRemovable = (value != 0);
+	}
+	if (_QueryRegistryDword(hKey, L"RootExitTimeout", value)) {
+		g_Settings.rootExitTimeout = value;
+	}
+	ZwClose(hKey);
+	DbgPrint(DRIVER_PREFIX "Attaching to: FS types: %X, device types: %X, removable media: %d\n",
+		g_Settings.attachFsTypes, g_Settings.attachDeviceTypes, g_Settings.attachRemovable);
+	DbgPrint(DRIVER_PREFIX "Root exit timeout: %d sec\n", g_Settings.rootExitTimeout);
+}
+
 NTSTATUS _InitializeDriver(_In_ PDRIVER_OBJECT DriverObject)
 {
 	UNICODE_STRING devName = RTL_CONSTANT_STRING(MY_DEVICE);
@@ -604,7 +983,8 @@ extern "C"
 NTSTATUS
 DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath) 
 {
-	UNREFERENCED_PARAMETER(RegistryPath);
+	// POOL_NX_OPTIN: NonPagedPool means the non-executable pool on Windows 8+ (and stays the same on Windows 7)
+	ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
 	// check version:
 	RTL_OSVERSIONINFOW version = { 0 };
@@ -619,14 +999,29 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 
 	// init all global data:
 	g_Settings.init();
+	_LoadSettings(RegistryPath);
+	NodeEvents::Init();
+	if (!Journal::Init()) {
+		// not critical: the client can still query the lists
+		DbgPrint(DRIVER_PREFIX "The journal is not available\n");
+	}
+	if (!TreeExport::Init()) {
+		DbgPrint(DRIVER_PREFIX "The snapshots of the trees are not available\n");
+	}
 
+	// on failure, the sections of the journal and the snapshots, as well as the state of the events, need to be freed too:
 	if (!Data::AllocGlobals()) {
 		DbgPrint(DRIVER_PREFIX "Failed to initialize global data structures\n");
+		MyDriverUnload(DriverObject);
 		return STATUS_FATAL_MEMORY_EXHAUSTION;
 	}
 	else {
 		KdPrint((DRIVER_PREFIX "Initialized global data structures!\n"));
 	}
+	if (!FileIdCache::Init()) {
+		MyDriverUnload(DriverObject);
+		return STATUS_FATAL_MEMORY_EXHAUSTION;
+	}
 
 	//
 	//  Register with FltMgr to tell it our callback routines
@@ -654,6 +1049,7 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 	DriverObject->DriverUnload = MyDriverUnload;
 	DriverObject->MajorFunction[IRP_MJ_CREATE] = HandleCreateClose;
 	DriverObject->MajorFunction[IRP_MJ_CLOSE] = HandleCreateClose;
+	DriverObject->MajorFunction[IRP_MJ_CLEANUP] = HandleCleanup;
 	DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = HandleDeviceControl;
 
 	KdPrint((DRIVER_PREFIX "driver loaded!\n"));
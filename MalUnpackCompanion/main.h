@@ -7,6 +7,17 @@
 #include "version.h"
 #include "common.h"
 
+// Volumes to attach to by default (can be overwritten in the registry, in the service key):
+// "AttachFsTypes": bitmask of the FLT_FILESYSTEM_TYPE values (1 << FsType)
+#define DEFAULT_ATTACH_FS_TYPES ((1 << FLT_FSTYPE_NTFS) | (1 << FLT_FSTYPE_REFS))
+// "AttachDeviceTypes": bitmask of the volume device types (1 << DeviceType)
+#define DEFAULT_ATTACH_DEVICE_TYPES (1 << FILE_DEVICE_DISK_FILE_SYSTEM)
+// "AttachRemovableMedia": 0 or 1
+#define DEFAULT_ATTACH_REMOVABLE false
+
+// "RootExitTimeout": how long (in seconds) the exiting root process waits for the permission to terminate (0: no limit)
+#define DEFAULT_ROOT_EXIT_TIMEOUT 300
+
 typedef struct _active_settings {
 
 	bool hasDevice;
@@ -15,6 +26,10 @@ typedef struct _active_settings {
 	PVOID RegHandle;
 	LARGE_INTEGER RegCookie;
 	PFLT_FILTER gFilterHandle;
+	ULONG attachFsTypes;
+	ULONG attachDeviceTypes;
+	bool attachRemovable;
+	ULONG rootExitTimeout; // in seconds
 
 	void init()
 	{
@@ -24,5 +39,9 @@ typedef struct _active_settings {
 		RegHandle = NULL;
 		RegCookie.QuadPart = 0;
 		gFilterHandle = NULL;
+		attachFsTypes = DEFAULT_ATTACH_FS_TYPES;
+		attachDeviceTypes = DEFAULT_ATTACH_DEVICE_TYPES;
+		attachRemovable = DEFAULT_ATTACH_REMOVABLE;
+		rootExitTimeout = DEFAULT_ROOT_EXIT_TIMEOUT;
 	}
 } active_settings;
@@ -0,0 +1,188 @@
+#include "node_events.h"
+
+// selects the IRP to be removed from the queue:
+struct NodeEventsPeekContext
+{
+	PFILE_OBJECT fileObject; // only the requests of this handle (NULL: any)
+	NodeEvent* evt; // if set: remove the request only if there is an event for it, and fetch the event
+};
+
+namespace NodeEvents {
+	IO_CSQ g_Csq;
+	LIST_ENTRY g_PendingIrps;
+	KSPIN_LOCK g_Lock; // guards both the pending IRPs and the backlog
+
+	NodeEvent g_Backlog[NODE_EVENTS_BACKLOG];
+	ULONG g_BacklogHead = 0;
+	ULONG g_BacklogCount = 0;
+	ULONG g_LostEvents = 0;
+
+	// the backlog helpers must be called with the lock held:
+
+	void _pushEvent(const NodeEvent& evt)
+	{
+		if (g_BacklogCount == NODE_EVENTS_BACKLOG) {
+			// the oldest event is dropped:
+			g_BacklogHead = (g_BacklogHead + 1) % NODE_EVENTS_BACKLOG;
+			g_BacklogCount--;
+			g_LostEvents++;
+		}
+		g_Backlog[(g_BacklogHead + g_BacklogCount) % NODE_EVENTS_BACKLOG] = evt;
+		g_BacklogCount++;
+	}
+
+	bool _popEvent(NodeEvent& evt)
+	{
+		if (g_BacklogCount == 0) {
+			return false;
+		}
+		evt = g_Backlog[g_BacklogHead];
+		evt.lostEvents = g_LostEvents;
+		g_LostEvents = 0;
+		g_BacklogHead = (g_BacklogHead + 1) % NODE_EVENTS_BACKLOG;
+		g_BacklogCount--;
+		return true;
+	}
+
+	// IO_CSQ callbacks:
+
+	NTSTATUS _csqInsertIrp(PIO_CSQ Csq, PIRP Irp, PVOID InsertContext)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+
+		// if the event is already waiting, the request is completed immediately instead of being queued:
+		NodeEvent* evt = static_cast<NodeEvent*>(InsertContext);
+		if (evt && _popEvent(*evt)) {
+			return STATUS_UNSUCCESSFUL;
+		}
+		InsertTailList(&g_PendingIrps, &Irp->Tail.Overlay.ListEntry);
+		return STATUS_SUCCESS;
+	}
+
+	void _csqRemoveIrp(PIO_CSQ Csq, PIRP Irp)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+		RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+	}
+
+	PIRP _csqPeekNextIrp(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+
+		NodeEventsPeekContext* ctx = static_cast<NodeEventsPeekContext*>(PeekContext);
+		PLIST_ENTRY entry = (Irp) ? Irp->Tail.Overlay.ListEntry.Flink : g_PendingIrps.Flink;
+		for (; entry != &g_PendingIrps; entry = entry->Flink) {
+			PIRP nextIrp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+			if (!ctx) {
+				return nextIrp;
+			}
+			if (ctx->fileObject && IoGetCurrentIrpStackLocation(nextIrp)->FileObject != ctx->fileObject) {
+				continue;
+			}
+			if (ctx->evt && !_popEvent(*ctx->evt)) {
+				return NULL;
+			}
+			return nextIrp;
+		}
+		return NULL;
+	}
+
+	_IRQL_raises_(DISPATCH_LEVEL)
+	_Acquires_lock_(g_Lock)
+	void _csqAcquireLock(PIO_CSQ Csq, PKIRQL Irql)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+		KeAcquireSpinLock(&g_Lock, Irql);
+	}
+
+	_Releases_lock_(g_Lock)
+	void _csqReleaseLock(PIO_CSQ Csq, KIRQL Irql)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+		KeReleaseSpinLock(&g_Lock, Irql);
+	}
+
+	void _csqCompleteCanceledIrp(PIO_CSQ Csq, PIRP Irp)
+	{
+		UNREFERENCED_PARAMETER(Csq);
+		Irp->IoStatus.Status = STATUS_CANCELLED;
+		Irp->IoStatus.Information = 0;
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+
+	void _completeWithEvent(PIRP Irp, const NodeEvent& evt)
+	{
+		::memcpy(Irp->AssociatedIrp.SystemBuffer, &evt, sizeof(NodeEvent));
+		Irp->IoStatus.Status = STATUS_SUCCESS;
+		Irp->IoStatus.Information = sizeof(NodeEvent);
+		IoCompleteRequest(Irp, IO_NO_INCREMENT);
+	}
+};
+
+void NodeEvents::Init()
+{
+	InitializeListHead(&g_PendingIrps);
+	KeInitializeSpinLock(&g_Lock);
+	g_BacklogHead = 0;
+	g_BacklogCount = 0;
+	g_LostEvents = 0;
+	IoCsqInitializeEx(&g_Csq, _csqInsertIrp, _csqRemoveIrp, _csqPeekNextIrp, _csqAcquireLock, _csqReleaseLock, _csqCompleteCanceledIrp);
+}
+
+void NodeEvents::Destroy()
+{
+	CancelPending(NULL);
+
+	KIRQL irql;
+	KeAcquireSpinLock(&g_Lock, &irql);
+	g_BacklogHead = 0;
+	g_BacklogCount = 0;
+	g_LostEvents = 0;
+	KeReleaseSpinLock(&g_Lock, irql);
+}
+
+void NodeEvents::Post(const NodeEvent& evt)
+{
+	KIRQL irql;
+	KeAcquireSpinLock(&g_Lock, &irql);
+	_pushEvent(evt);
+	KeReleaseSpinLock(&g_Lock, irql);
+
+	// hand over the oldest event to the first pending request (if any):
+	NodeEvent nextEvt = { 0 };
+	NodeEventsPeekContext ctx = { NULL, &nextEvt };
+	PIRP Irp = IoCsqRemoveNextIrp(&g_Csq, &ctx);
+	if (Irp) {
+		_completeWithEvent(Irp, nextEvt);
+	}
+}
+
+NTSTATUS NodeEvents::WaitForEvent(PIRP Irp, ULONG_PTR& outLen)
+{
+	PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+	const size_t outBufSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
+	if (outBufSize < sizeof(NodeEvent)) {
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+	void* outBuf = Irp->AssociatedIrp.SystemBuffer;
+	if (outBuf == nullptr) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	NodeEvent evt = { 0 };
+	if (NT_SUCCESS(IoCsqInsertIrpEx(&g_Csq, Irp, NULL, &evt))) {
+		return STATUS_PENDING;
+	}
+	// the event was already in the backlog:
+	::memcpy(outBuf, &evt, sizeof(NodeEvent));
+	outLen = sizeof(NodeEvent);
+	return STATUS_SUCCESS;
+}
+
+void NodeEvents::CancelPending(PFILE_OBJECT FileObject)
+{
+	NodeEventsPeekContext ctx = { FileObject, NULL };
+	PIRP Irp = NULL;
+	while ((Irp = IoCsqRemoveNextIrp(&g_Csq, (FileObject) ? &ctx : NULL)) != NULL) {
+		_csqCompleteCanceledIrp(&g_Csq, Irp);
+	}
+}
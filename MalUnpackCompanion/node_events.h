@@ -0,0 +1,26 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "common.h"
+
+#define NODE_EVENTS_BACKLOG 64 // the events kept while no request is pending
+
+// The queue of the pending IOCTL_MUNPACK_COMPANION_WAIT_NODE_EVENT requests (cancel-safe).
+// Each event completes one pending request - or, if none is pending, waits in the backlog for the next one.
+
+namespace NodeEvents {
+
+    void Init();
+
+    // cancels all the pending requests and clears the backlog
+    void Destroy();
+
+    // may be called at IRQL <= DISPATCH_LEVEL
+    void Post(const NodeEvent& evt);
+
+    // returns STATUS_PENDING if the request was queued (then it must not be completed by the caller)
+    NTSTATUS WaitForEvent(PIRP Irp, ULONG_PTR& outLen);
+
+    // cancels the requests pending on the given handle
+    void CancelPending(PFILE_OBJECT FileObject);
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+// The basic types and primitives used by the portable structures (see data_structs.h):
+// the kernel ones in the driver, and their user-mode equivalents in the tests and benchmarks.
+
+#if defined(_KERNEL_MODE)
+
+#include <fltKernel.h>
+
+#else // user mode
+
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <stdint.h>
+
+	typedef uint8_t UCHAR;
+	typedef int32_t LONG;
+	typedef uint32_t ULONG;
+	typedef int64_t LONGLONG;
+	typedef uint64_t ULONGLONG;
+
+	inline LONG InterlockedOr(volatile LONG* target, LONG value)
+	{
+		return __atomic_fetch_or(target, value, __ATOMIC_SEQ_CST);
+	}
+
+	inline LONG InterlockedAnd(volatile LONG* target, LONG value)
+	{
+		return __atomic_fetch_and(target, value, __ATOMIC_SEQ_CST);
+	}
+#endif
+
+typedef enum {
+	NonPagedPool = 0,
+	PagedPool = 1
+} POOL_TYPE;
+
+inline void* ExAllocatePoolWithTag(POOL_TYPE, size_t size, ULONG)
+{
+	return ::malloc(size);
+}
+
+inline void ExFreePool(void* buf)
+{
+	::free(buf);
+}
+
+#endif // _KERNEL_MODE
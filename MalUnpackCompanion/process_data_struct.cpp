@@ -1,15 +1,14 @@
 #include "process_data_struct.h"
 
-bool ProcessNode::_containsFile(LONGLONG fileId)
+bool ProcessNode::_containsFile(FileKey fileKey)
 {
 	if (!filesList) return false;
-	return filesList->containsItem(fileId);
+	return filesList->containsItem(fileKey);
 }
 
 bool ProcessNode::_isDeadNode()
 {
-	if (!processList) return true;
-	return (processList->containsItem(rootPid)) ? false : true;
+	return (processList.containsItem(rootPid)) ? false : true;
 }
 
 bool ProcessNode::_isEmptyNode()
@@ -28,7 +27,7 @@ bool ProcessNode::_isEmptyNode()
 	// allow for the initial file to still exist:
 	if (respawnProtect == t_noresp::NORESP_DROPPED_FILES) {
 		if (filesCount == 1) {
-			if (imgFile != FILE_INVALID_FILE_ID && _containsFile(imgFile)) {
+			if (FileKeys::isValid(imgFile) && _containsFile(imgFile)) {
 				return true;
 			}
 		}
@@ -38,8 +37,7 @@ bool ProcessNode::_isEmptyNode()
 
 bool ProcessNode::_containsProcess(ULONG pid)
 {
-	if (!processList) return false;
-	return processList->containsItem(pid);
+	return processList.containsItem(pid);
 }
 
 bool ProcessNode::_canAddFile()
@@ -49,14 +47,13 @@ bool ProcessNode::_canAddFile()
 		return false;
 	}
 	if (!filesList) {
-		if (!_initItems()) {
-			return false;
-		}
+		// the list will be initialized on the first add (this check runs under a shared lock, so it must not modify the node)
+		return true;
 	}
 	return filesList->canAddItem();
 }
 
-t_add_status ProcessNode::_addFile(LONGLONG fileId)
+t_add_status ProcessNode::_addFile(FileKey fileKey)
 {
 	if (_isDeadNode()) {
 		// the root process terminated, do not allow to add more files to the list
@@ -67,29 +64,23 @@ t_add_status ProcessNode::_addFile(LONGLONG fileId)
 			return ADD_UNINITIALIZED;
 		}
 	}
-	return filesList->addItem(fileId);
+	return filesList->addItem(fileKey);
 }
 
 t_add_status ProcessNode::_addProcess(ULONG pid)
 {
-	if (!processList) {
-		if (!_initItems()) {
-			return ADD_UNINITIALIZED;
-		}
-	}
 	if (pid != rootPid) {
 		if (_isDeadNode()) {
 			// the root process terminated, do not allow to add more processes to this list
 			return ADD_LIMIT_EXHAUSTED;
 		}
 	}
-	return processList->addItem(pid);
+	return processList.addItem(pid);
 }
 
 int ProcessNode::_countProcesses()
 {
-	if (!processList) return 0;
-	return processList->countItems();
+	return processList.countItems();
 };
 
 int ProcessNode::_countFiles()
@@ -100,20 +91,18 @@ int ProcessNode::_countFiles()
 
 bool ProcessNode::_deleteProcess(ULONG pid)
 {
-	if (!processList) return false;
-	return processList->deleteItem(pid);
+	return processList.deleteItem(pid);
 }
 
-bool ProcessNode::_deleteFile(LONGLONG fileId)
+bool ProcessNode::_deleteFile(FileKey fileKey)
 {
 	if (!filesList) return false;
-	return filesList->deleteItem(fileId);
+	return filesList->deleteItem(fileKey);
 }
 
 size_t ProcessNode::_copyProcessList(void* data, size_t outBufSize)
 {
-	if (!processList) return 0;
-	return processList->copyItems(data, outBufSize);
+	return processList.copyItems(data, outBufSize);
 }
 
 size_t ProcessNode::_copyFilesList(void* data, size_t outBufSize)
@@ -121,3 +110,38 @@ size_t ProcessNode::_copyFilesList(void* data, size_t outBufSize)
 	if (!filesList) return 0;
 	return filesList->copyItems(data, outBufSize);
 }
+
+size_t ProcessNode::_copyProcessPage(ULONG cursor, ULONG& nextCursor, void* data, size_t outBufSize)
+{
+	size_t nextSlot = 0;
+	const size_t copied = processList.copyItemsPage(cursor, nextSlot, data, outBufSize);
+	nextCursor = ULONG(nextSlot);
+	return copied;
+}
+
+size_t ProcessNode::_copyFilesPage(ULONG cursor, ULONG& nextCursor, void* data, size_t outBufSize)
+{
+	nextCursor = 0;
+	if (!filesList) return 0;
+	size_t nextSlot = 0;
+	const size_t copied = filesList->copyItemsPage(cursor, nextSlot, data, outBufSize);
+	nextCursor = ULONG(nextSlot);
+	return copied;
+}
+
+size_t ProcessNode::_copyFileIdsList(void* data, size_t outBufSize)
+{
+	if (!filesList) return 0;
+	if (!data || outBufSize < sizeof(LONGLONG)) return 0;
+
+	const size_t maxItemsToCopy = outBufSize / sizeof(LONGLONG);
+	::memset(data, 0, outBufSize);
+	LONGLONG* outItems = (LONGLONG*)data;
+	size_t copied = 0;
+	filesList->forEachItem([outItems, maxItemsToCopy, &copied](FileKey fileKey) {
+		if (copied < maxItemsToCopy) {
+			outItems[copied++] = FileKeys::toFileId(fileKey);
+		}
+	});
+	return copied;
+}
@@ -1,10 +1,86 @@
 #pragma once
 #include "data_structs.h"
+#include "kernel_sync.h"
 #include "common.h"
+#include "file_key.h"
 
-#ifndef FILE_INVALID_FILE_ID
-	#define FILE_INVALID_FILE_ID               ((LONGLONG)-1LL) 
-#endif
+// most of the watched trees consist of just a few processes:
+#define PROCESS_LIST_INLINE_ITEMS 8
+
+// the limit of the parents recorded at the process creation (if exhausted, the parent is queried from the system):
+#define MAX_RECORDED_PARENTS 4096
+
+// The parent of a process, as recorded at its creation:
+
+struct ParentInfo
+{
+	ULONG parentPid;
+	LONGLONG createTime; // of the child: tells apart the processes that reused the same PID
+};
+
+// The relation of a process to the watched trees, and to the given file:
+
+struct CallerInfo
+{
+	ULONG rootPid;		// root of the tree containing the process (0: the process is not watched)
+	ULONG fileOwner;	// root of the tree containing the file (0: the file is not watched)
+	bool isFileOwner;	// the file belongs to the tree of the process
+	bool canAddFile;	// the process is allowed to add new files to its tree
+
+	void init()
+	{
+		rootPid = 0;
+		fileOwner = 0;
+		isFileOwner = false;
+		canAddFile = false;
+	}
+
+	bool isWatched() const { return rootPid != 0; }
+
+	bool isFileWatched() const { return fileOwner != 0; }
+};
+
+// Notified about every change of the watched trees. Called with the list locked exclusively (so, never concurrently),
+// and it must not call back into the list.
+
+typedef void (*t_node_listener)(const NodeEvent& evt);
+
+//---
+
+// Signaled when the root process of the node is deleted from it (or the node is destroyed).
+// Shared by the node and the threads waiting for it, and freed by the one releasing it last.
+// Allocated from the non-paged pool, since it is waited on.
+
+struct NodeWaiter
+{
+	Event event;
+	volatile LONG refCount;
+
+	static NodeWaiter* create()
+	{
+		NodeWaiter* waiter = AllocBuffer<NodeWaiter>(1, true, NonPagedPool);
+		if (!waiter) {
+			return nullptr;
+		}
+		waiter->event.Init();
+		waiter->refCount = 1;
+		return waiter;
+	}
+
+	void addRef()
+	{
+		InterlockedIncrement(&refCount);
+	}
+
+	void release()
+	{
+		if (InterlockedDecrement(&refCount) == 0) {
+			FreeBuffer<NodeWaiter>(this);
+		}
+	}
+};
+
+//---
 
 struct ProcessNode
 {
@@ -12,15 +88,20 @@ struct ProcessNode
 
 protected:
 	ULONG rootPid;
-	LONGLONG imgFile;
-	ItemsList<ULONG> *processList;
-	ItemsList<LONGLONG> *filesList;
+	FileKey imgFile;
+	// the lists are guarded by ProcessNodesList::Mutex:
+	SmallItemsList<ULONG, PROCESS_LIST_INLINE_ITEMS> processList;
+	ItemsList<FileKey, NoLock> *filesList;
 	t_noresp respawnProtect;
+	NodeWaiter* rootWaiter; // created only when the root process is waiting for the permission to terminate
+	ULONG generation; // of the last change of the node: unique among all the nodes
 
-	void _init(ULONG _pid, t_noresp _respawnProtect, LONGLONG _imgFile)
+	void _init(ULONG _pid, t_noresp _respawnProtect, FileKey _imgFile)
 	{
-		processList = NULL;
+		processList.init();
+		generation = 0;
 		filesList = NULL;
+		rootWaiter = NULL;
 		rootPid = _pid;
 		imgFile = _imgFile;
 		respawnProtect = _respawnProtect;
@@ -28,32 +109,18 @@ protected:
 
 	bool _initItems()
 	{
-		if (!processList) {
-			processList = AllocBuffer<ItemsList<ULONG> >();
-			if (!processList) {
-				_destroy();
-				DbgPrint(DRIVER_PREFIX "Failed to initialize processList!\n");
-				return false;
-			}
-		}
 		if (!filesList) {
-			filesList = AllocBuffer<ItemsList<LONGLONG> >();
+			filesList = AllocBuffer<ItemsList<FileKey, NoLock> >();
 			if (!filesList) {
-				_destroy();
 				DbgPrint(DRIVER_PREFIX "Failed to initialize filesList!\n");
 				return false;
 			}
 		}
-		processList->init();
-		if (!processList->initItems()) {
-			DbgPrint(DRIVER_PREFIX "Failed to initialize processList items!\n");
-			_destroy();
-			return false;
-		}
 		filesList->init();
 		if (!filesList->initItems()) {
 			DbgPrint(DRIVER_PREFIX "Failed to initialize filesList items!\n");
-			_destroy();
+			FreeBuffer(filesList);
+			filesList = NULL;
 			return false;
 		}
 		DbgPrint(DRIVER_PREFIX "ProcessNode: initialized lists!\n");
@@ -62,18 +129,19 @@ protected:
 
 	void _destroy()
 	{
-		if (processList) {
-			processList->destroy();
-			FreeBuffer(processList);
-			processList = NULL;
+		_signalRootDeleted();
+		if (rootWaiter) {
+			rootWaiter->release();
+			rootWaiter = NULL;
 		}
+		processList.destroy();
 		if (filesList) {
 			filesList->destroy();
 			FreeBuffer(filesList);
 			filesList = NULL;
 		}
 		rootPid = 0;
-		imgFile = FILE_INVALID_FILE_ID;
+		imgFile = FileKeys::invalidKey();
 		respawnProtect = t_noresp::NORESP_NO_RESTRICTION;
 	}
 
@@ -83,18 +151,26 @@ protected:
 		return true;
 	}
 
+	// wakes up the root process waiting for the permission to terminate (if any)
+	void _signalRootDeleted()
+	{
+		if (rootWaiter) {
+			rootWaiter->event.SetEvent();
+		}
+	}
+
 	// check if the root process terminated
 	bool _isDeadNode();
 
 	bool _isEmptyNode();
 
-	bool _containsFile(LONGLONG fileId);
+	bool _containsFile(FileKey fileKey);
 
 	bool _containsProcess(ULONG pid);
 
 	bool _canAddFile();
 
-	t_add_status _addFile(LONGLONG fileId);
+	t_add_status _addFile(FileKey fileKey);
 
 	t_add_status _addProcess(ULONG pid);
 
@@ -104,12 +180,20 @@ protected:
 
 	bool _deleteProcess(ULONG pid);
 
-	bool _deleteFile(LONGLONG);
+	bool _deleteFile(FileKey);
 
 	size_t _copyProcessList(void* data, size_t outBufSize);
 
 	size_t _copyFilesList(void* data, size_t outBufSize);
 
+	// copies the 64-bit IDs of the files (the legacy format of the list, see FileKeys::toFileId)
+	size_t _copyFileIdsList(void* data, size_t outBufSize);
+
+	// the cursor is the slot in the list where the page starts: nextCursor is where the next one starts (0: none)
+	size_t _copyProcessPage(ULONG cursor, ULONG& nextCursor, void* data, size_t outBufSize);
+
+	size_t _copyFilesPage(ULONG cursor, ULONG& nextCursor, void* data, size_t outBufSize);
+
 };
 
 //---
@@ -122,32 +206,54 @@ public:
 		Items = 0;
 		MaxItemCount = 0;
 		ItemCount = 0;
+		ActiveNodes = 0;
+		PidIndex.init();
+		FileIndex.init();
+		ParentIndex.init();
+		WatchedPids.init();
+		Listener = NULL;
+		Generation = 0;
 		Mutex.Init();
-		deletionEvent.Init();
+	}
+
+	void SetListener(t_node_listener listener)
+	{
+		AutoLock<PushLock> lock(Mutex);
+		Listener = listener;
 	}
 
 	bool initItems(int maxNum = MAX_ITEMS)
 	{
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 		if (Items) {
 			return true;
 		}
 		ItemCount = 0;
 		Items = AllocBuffer<ProcessNode>(maxNum + 1);
-		if (Items != NULL) {
-			MaxItemCount = maxNum;
-			return true;
+		if (Items == NULL) {
+			return false;
 		}
-		return false;
+		if (!ParentIndex.initItems(MAX_RECORDED_PARENTS)) {
+			FreeBuffer<ProcessNode>(Items, maxNum + 1);
+			Items = NULL;
+			return false;
+		}
+		MaxItemCount = maxNum;
+		return true;
 	}
 
 	bool destroy()
 	{
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 		if (Items) {
 			_destroyItems();
+			PidIndex.destroy();
+			FileIndex.destroy();
+			ParentIndex.destroy();
+			WatchedPids.init();
 			FreeBuffer<ProcessNode>(Items, MaxItemCount);
 			ItemCount = 0;
+			InterlockedExchange(&ActiveNodes, 0);
 			MaxItemCount = 0;
 			Items = NULL;
 			return true;
@@ -163,16 +269,16 @@ public:
 		if (0 == parentPid) {
 			return ADD_NO_PARENT;
 		}
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 		return _addToExistingTree(pid, parentPid);
 	}
 
-	t_add_status AddProcessNode(ULONG pid, LONGLONG imgFile, t_noresp respawnProtect)
+	t_add_status AddProcessNode(ULONG pid, FileKey imgFile, t_noresp respawnProtect)
 	{
 		if (0 == pid) {
 			return ADD_INVALID_ITEM;
 		}
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 		if (_ContainsProcess(pid)) {
 			return ADD_FORBIDDEN;
 		}
@@ -185,7 +291,7 @@ public:
 			return false;
 		}
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 		if (_CanAddFile(parentPid) == ADD_OK) {
 			return true;
 		}
@@ -198,22 +304,45 @@ public:
 		if (!n._isEmptyNode()) {
 			return false;
 		}
+		_notify(n, NODE_EVENT_TREE_EMPTY, 0, FileKeys::invalidKey());
+		// the files that were allowed to remain are no longer watched:
+		if (n.filesList) {
+			n.filesList->forEachItem([this](FileKey fileKey) {
+				FileIndex.deleteItem(fileKey);
+			});
+		}
 		n._destroy();
 		//rewrite the last element on the place of the current:
-		if (ItemCount > 1) {
-			Items[i]._copy(Items[ItemCount - 1]);
+		const int lastIndx = ItemCount - 1;
+		if (i != lastIndx) {
+			ProcessNode& moved = Items[i];
+			moved._copy(Items[lastIndx]);
+			// the processes and files of the moved node are now at the new index:
+			moved.processList.forEachItem([this, i](ULONG pid) {
+				PidIndex.setItem(pid, i);
+			});
+			if (moved.filesList) {
+				moved.filesList->forEachItem([this, i](FileKey fileKey) {
+					FileIndex.setItem(fileKey, i);
+				});
+			}
 		}
 		ItemCount--;
+		InterlockedDecrement(&ActiveNodes);
+		if (ItemCount == 0) {
+			// no process is watched anymore, so none of the recorded parents matters
+			ParentIndex.destroy();
+		}
 		return true;
 	}
 
-	t_add_status AddFile(LONGLONG fileId, ULONG parentPid)
+	t_add_status AddFile(FileKey fileKey, ULONG parentPid)
 	{
-		if (0 == parentPid || FILE_INVALID_FILE_ID == fileId) {
+		if (0 == parentPid || !FileKeys::isValid(fileKey)) {
 			return ADD_INVALID_ITEM;
 		}
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 
 		t_add_status canAddStatus = _CanAddFile(parentPid);
 		if (canAddStatus == ADD_NO_PARENT) {
@@ -224,81 +353,81 @@ public:
 			return canAddStatus;
 		}
 		// if this file belongs to a dead node, delete the association first:
-		const t_delete_status delStatus = _deletePreviousFileAssociation(fileId, parentPid);
+		const t_delete_status delStatus = _deletePreviousFileAssociation(fileKey, parentPid);
 		if (delStatus == DELETE_FORBIDDEN) {
 			return ADD_FORBIDDEN;
 		}
 
 		// add the file to the process:
-		return _addFile(fileId, parentPid);
+		return _addFile(fileKey, parentPid);
 	}
 
-	bool IsProcessInFileOwners(ULONG PID, LONGLONG fileId)
+	bool IsProcessInFileOwners(ULONG PID, FileKey fileKey)
 	{
-		if (0 == PID || FILE_INVALID_FILE_ID == fileId) {
+		if (0 == PID || !FileKeys::isValid(fileKey)) {
 			return false;
 		}
 
-		AutoLock<FastMutex> lock(Mutex);
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsFile(fileId)) {
-				if (n._containsProcess(PID)) {
-					return true;
-				}
-				return false;
-			}
+		AutoSharedLock<PushLock> lock(Mutex);
+		const int fileNode = _findFileNode(fileKey);
+		if (fileNode == INVALID_INDEX) {
+			return false;
 		}
-		return false;
+		return (_findProcessNode(PID) == fileNode);
 	}
 
 	bool DeleteProcess(ULONG pid)
 	{
 		if (0 == pid) return false;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(pid)) {
-				if (n._deleteProcess(pid)) {
-					if (n._isDeadNode()) {
-						deletionEvent.SetEvent();
-					}
-					_DestroyNodeIfEmpty(i);
-					return true;
-				}
-			}
+		const int i = _findProcessNode(pid);
+		if (i == INVALID_INDEX) {
+			return false;
 		}
-		return false;
+		ProcessNode& n = Items[i];
+		if (!n._deleteProcess(pid)) {
+			return false;
+		}
+		PidIndex.deleteItem(pid);
+		ParentIndex.deleteItem(pid);
+		WatchedPids.clearPid(pid);
+		if (n.rootPid == pid) {
+			n._signalRootDeleted();
+			_notify(n, NODE_EVENT_ROOT_DELETED, pid, FileKeys::invalidKey());
+		}
+		else {
+			_notify(n, NODE_EVENT_PROCESS_DELETED, pid, FileKeys::invalidKey());
+		}
+		_DestroyNodeIfEmpty(i);
+		return true;
 	}
 
-	bool DeleteFile(LONGLONG fileId)
+	bool DeleteFile(FileKey fileKey)
 	{
-		if (FILE_INVALID_FILE_ID == fileId) return false;
+		if (!FileKeys::isValid(fileKey)) return false;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoLock<PushLock> lock(Mutex);
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsFile(fileId)) {
-				if (n._deleteFile(fileId)) {
-					_DestroyNodeIfEmpty(i);
-					return true;
-				}
-			}
+		const int i = _findFileNode(fileKey);
+		if (i == INVALID_INDEX) {
+			return false;
 		}
-		return false;
+		if (!Items[i]._deleteFile(fileKey)) {
+			return false;
+		}
+		FileIndex.deleteItem(fileKey);
+		_notify(Items[i], NODE_EVENT_FILE_DELETED, 0, fileKey);
+		_DestroyNodeIfEmpty(i);
+		return true;
 	}
 
 	size_t CopyProcessList(ULONG parentPid, void* data, size_t outBufSize)
 	{
 		if (0 == parentPid) return 0;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 
 		for (int i = 0; i < ItemCount; i++)
 		{
@@ -314,7 +443,7 @@ public:
 	{
 		if (0 == parentPid) return 0;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 
 		for (int i = 0; i < ItemCount; i++)
 		{
@@ -326,58 +455,80 @@ public:
 		return 0;
 	}
 
-	int CountProcesses(ULONG parentPid)
+	size_t CopyFileIdsList(ULONG parentPid, void* data, size_t outBufSize)
 	{
 		if (0 == parentPid) return 0;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 
 		for (int i = 0; i < ItemCount; i++)
 		{
 			ProcessNode& n = Items[i];
 			if (n.rootPid == parentPid) {
-				return n._countProcesses();
+				return n._copyFileIdsList(data, outBufSize);
 			}
 		}
 		return 0;
 	}
 
-	int CountNodes()
+	// copies the page of the processes list, starting from the cursor; false if there is no tree with such root
+	bool CopyProcessPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize)
 	{
-		AutoLock<FastMutex> lock(Mutex);
-		return ItemCount;
+		return _copyPage(rootPid, cursor, header, data, outBufSize, false);
 	}
 
-	ULONG GetFileOwner(LONGLONG fileId)
+	// copies the page of the files list (as FileKey-s), starting from the cursor; false if there is no tree with such root
+	bool CopyFilesPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize)
 	{
-		if (FILE_INVALID_FILE_ID == fileId) return 0;
+		return _copyPage(rootPid, cursor, header, data, outBufSize, true);
+	}
 
-		AutoLock<FastMutex> lock(Mutex);
+	int CountProcesses(ULONG parentPid)
+	{
+		if (0 == parentPid) return 0;
+
+		AutoSharedLock<PushLock> lock(Mutex);
 
 		for (int i = 0; i < ItemCount; i++)
 		{
 			ProcessNode& n = Items[i];
-			if (n._containsFile(fileId)) {
-				return n.rootPid;
+			if (n.rootPid == parentPid) {
+				return n._countProcesses();
 			}
 		}
 		return 0;
 	}
 
+	int CountNodes()
+	{
+		AutoSharedLock<PushLock> lock(Mutex);
+		return ItemCount;
+	}
+
+	ULONG GetFileOwner(FileKey fileKey)
+	{
+		if (!FileKeys::isValid(fileKey)) return 0;
+
+		AutoSharedLock<PushLock> lock(Mutex);
+
+		const int i = _findFileNode(fileKey);
+		if (i == INVALID_INDEX) {
+			return 0;
+		}
+		return Items[i].rootPid;
+	}
+
 	ULONG GetProcessOwner(ULONG pid)
 	{
 		if (0 == pid) return 0;
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(pid)) {
-				return n.rootPid;
-			}
+		const int i = _findProcessNode(pid);
+		if (i == INVALID_INDEX) {
+			return 0;
 		}
-		return 0;
+		return Items[i].rootPid;
 	}
 
 	bool AreSameFamily(ULONG pid1, ULONG pid2)
@@ -389,55 +540,176 @@ public:
 			return true;
 		}
 
-		AutoLock<FastMutex> lock(Mutex);
+		AutoSharedLock<PushLock> lock(Mutex);
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(pid1)) {
-				if (n._containsProcess(pid2)) {
-					return true;
-				}
-				else {
-					return false;
-				}
-			}
+		const int i = _findProcessNode(pid1);
+		if (i == INVALID_INDEX) {
+			return false;
 		}
-		return false;
+		return (_findProcessNode(pid2) == i);
 	}
 
-	bool ContainsProcess(ULONG pid1)
+	// Adds the newly created process to the tree of its parent, or (if the parent is not watched) of its creator,
+	// and records its parent (if watched) - all within a single lock.
+	// ownerPid: the root of the tree that the process was added to
+	t_add_status AddCreatedProcess(ULONG pid, ULONG parentPid, ULONG creatorPid, LONGLONG createTime, ULONG& ownerPid)
 	{
-		if (0 == pid1) return false;
+		ownerPid = 0;
+		if (0 == pid) {
+			return ADD_INVALID_ITEM;
+		}
+		if (!MayContainProcess(parentPid) && !MayContainProcess(creatorPid)) {
+			return ADD_NO_PARENT;
+		}
 
-		AutoLock<FastMutex> lock(Mutex);
-		return _ContainsProcess(pid1);
+		AutoLock<PushLock> lock(Mutex);
+
+		const int parentNode = (parentPid) ? _findProcessNode(parentPid) : INVALID_INDEX;
+		const int creatorNode = (creatorPid && creatorPid != parentPid) ? _findProcessNode(creatorPid) : INVALID_INDEX;
+		t_add_status status = ADD_NO_PARENT;
+		if (parentNode != INVALID_INDEX) {
+			status = _addProcessToNode(parentNode, pid);
+			if (status == ADD_OK || status == ADD_ALREADY_EXIST) {
+				ownerPid = Items[parentNode].rootPid;
+			}
+		}
+		if (!ownerPid && creatorNode != INVALID_INDEX && creatorNode != parentNode) {
+			status = _addProcessToNode(creatorNode, pid);
+			if (status == ADD_OK || status == ADD_ALREADY_EXIST) {
+				ownerPid = Items[creatorNode].rootPid;
+			}
+		}
+		if (ownerPid && parentNode != INVALID_INDEX) {
+			// so that the relation does not need to be queried when the process is opened
+			// (only once the process is in a tree: DeleteProcess, that erases the entry, ignores any other PID)
+			ParentInfo info = { parentPid, createTime };
+			ParentIndex.setItem(pid, info);
+		}
+		return status;
 	}
 
-	NTSTATUS WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER checkInterval)
+	// checks within a single lookup if the target process belongs to the tree of the source process, or is a child of a process from this tree
+	// (systemParentPid: the parent reported by the system, used if the parent of the target was not recorded at its creation)
+	bool IsRelatedProcess(ULONG sourcePid, ULONG targetPid, LONGLONG targetCreateTime, ULONG systemParentPid)
 	{
-		if (0 == pid) return STATUS_INVALID_PARAMETER;
+		if (0 == sourcePid || 0 == targetPid) {
+			return false;
+		}
+		if (sourcePid == targetPid) {
+			return true;
+		}
+
+		AutoSharedLock<PushLock> lock(Mutex);
 
-		LONGLONG waitTime = (checkInterval) ? checkInterval->QuadPart : 0;
-		bool isRoot = false;
+		const int sourceNode = _findProcessNode(sourcePid);
+		if (sourceNode == INVALID_INDEX) {
+			return false;
+		}
+		if (_findProcessNode(targetPid) == sourceNode) {
+			return true;
+		}
+		ULONG parentPid = systemParentPid;
+		ParentInfo info = { 0 };
+		if (ParentIndex.getItem(targetPid, info) && info.createTime == targetCreateTime) {
+			parentPid = info.parentPid;
+		}
+		if (0 == parentPid) {
+			return false;
+		}
+		return (_findProcessNode(parentPid) == sourceNode);
+	}
 
-		ULONG ownerPID = 0;
-		while ((ownerPID = GetProcessOwner(pid)) == pid) {
-			// if the given PID is a root, don't let it terminate without permission
-			isRoot = true;
+	// fills all the info about the caller and the file within a single lookup
+	void ClassifyCaller(ULONG pid, FileKey fileKey, CallerInfo& info)
+	{
+		info.init();
+		if (!FileKeys::isValid(fileKey) && !WatchedPids.mayContainPid(pid)) {
+			return;
+		}
 
-			DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": process requested terminate, waitTime: %zx (owner: %d, remaining children: %d)\n", pid, waitTime, pid, CountProcesses(pid));
-			deletionEvent.ResetEvent();
-			deletionEvent.WaitForEventSet(checkInterval);
+		AutoSharedLock<PushLock> lock(Mutex);
+
+		const int pidNode = _findProcessNode(pid);
+		if (pidNode != INVALID_INDEX) {
+			ProcessNode& n = Items[pidNode];
+			info.rootPid = n.rootPid;
+			info.canAddFile = n._canAddFile();
+		}
+		const int fileNode = _findFileNode(fileKey);
+		if (fileNode != INVALID_INDEX) {
+			info.fileOwner = Items[fileNode].rootPid;
+			info.isFileOwner = (fileNode == pidNode);
 		}
-		if (isRoot) {
-			DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": root process termination permitted!\n", pid, waitTime, pid);
+	}
+
+	// may be called without the lock: false means that no process tree is currently watched
+	bool HasActiveNodes() const
+	{
+		return ActiveNodes != 0;
+	}
+
+	// may be called without the lock: a false result means the process is surely not watched
+	bool MayContainProcess(ULONG pid1) const
+	{
+		if (0 == pid1) return false;
+
+		return WatchedPids.mayContainPid(pid1);
+	}
+
+	bool ContainsProcess(ULONG pid1)
+	{
+		if (!MayContainProcess(pid1)) return false;
+
+		AutoSharedLock<PushLock> lock(Mutex);
+		return _ContainsProcess(pid1);
+	}
+
+	// timeout: the limit of waiting for the permission to terminate the root process, relative (negative, in 100ns units); NULL: no limit
+	NTSTATUS WaitForProcessDeletion(ULONG pid, PLARGE_INTEGER timeout)
+	{
+		if (0 == pid) return STATUS_INVALID_PARAMETER;
+		if (!MayContainProcess(pid)) return STATUS_SUCCESS;
+
+		// if the given PID is a root, don't let it terminate without permission:
+		NodeWaiter* waiter = _acquireRootWaiter(pid);
+		if (waiter) {
+			const LONGLONG waitTime = (timeout) ? timeout->QuadPart : 0;
+			DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": process requested terminate, waitTime: %llx (remaining children: %d)\n", pid, waitTime, CountProcesses(pid));
+
+			// the wait may be interrupted (by the APCs, as it is alertable), so the deadline is fixed upfront, and each wait gets the remaining time:
+			const ULONGLONG deadline = (timeout) ? (KeQueryInterruptTime() + ULONGLONG(-timeout->QuadPart)) : 0;
+			bool isTimeout = false;
+			// only the deletion of this root wakes up the waiter:
+			while (GetProcessOwner(pid) == pid) {
+				LARGE_INTEGER remaining = { 0 };
+				if (timeout) {
+					const ULONGLONG now = KeQueryInterruptTime();
+					if (now >= deadline) {
+						isTimeout = true;
+						break;
+					}
+					remaining.QuadPart = -LONGLONG(deadline - now);
+				}
+				const NTSTATUS status = waiter->event.WaitForEventSet((timeout) ? &remaining : NULL);
+				if (status == STATUS_TIMEOUT) {
+					isTimeout = true;
+					break;
+				}
+				// STATUS_ALERTED, STATUS_USER_APC: keep waiting, for the remaining time only
+			}
+			waiter->release();
+			if (isTimeout) {
+				DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": root process termination permitted after the timeout!\n", pid);
+			}
+			else {
+				DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": root process termination permitted!\n", pid);
+			}
 		}
 
-		if (ownerPID != 0) {
+		if (GetProcessOwner(pid) != 0) {
 			// the process is still on the list, so delete it
-			// this may happen in case of a child process that is terminating on its own
-			DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": child process termination permitted!\n", pid, waitTime, pid);
+			// this may happen in case of a child process that is terminating on its own (or the root, if the wait timed out)
+			DbgPrint(DRIVER_PREFIX "[%d] " __FUNCTION__ ": process termination permitted!\n", pid);
 			DeleteProcess(pid);
 		}
 		return STATUS_SUCCESS;
@@ -448,52 +720,163 @@ private:
 	ProcessNode* Items;
 	int ItemCount;
 	int MaxItemCount;
-	FastMutex Mutex;
-	Event deletionEvent;
+	volatile LONG ActiveNodes; // mirrors ItemCount, but can be read without the lock
+	ItemsMap<ULONG, int> PidIndex; // PID -> index of the node containing the process
+	ItemsMap<FileKey, int> FileIndex; // file key -> index of the node containing the file
+	ItemsMap<ULONG, ParentInfo> ParentIndex; // PID -> parent recorded at the creation (only the children of the watched processes)
+	PidBitmap WatchedPids; // lock-free mirror of the PidIndex keys, for the "not watched" fast path
+	PushLock Mutex; // queries take it shared, modifications exclusive
+	t_node_listener Listener;
+	ULONG Generation; // of the last change of any node
 
+	// to be called on each change of the node
+	void _notify(ProcessNode& n, t_node_event type, ULONG pid, const FileKey& fileKey)
+	{
+		Generation++;
+		if (Generation == 0) {
+			Generation++; // 0 is reserved for the nodes that were not modified yet
+		}
+		n.generation = Generation;
 
-	bool _ContainsProcess(ULONG pid1)
+		if (!Listener) return;
+
+		NodeEvent evt = { 0 };
+		evt.type = type;
+		evt.rootPid = n.rootPid;
+		evt.pid = pid;
+		evt.fileKey = fileKey;
+		Listener(evt);
+	}
+
+	// returns the waiter of the node, if the process is its (still watched) root, with the reference added for the caller
+	NodeWaiter* _acquireRootWaiter(ULONG pid)
 	{
-		if (0 == pid1) return false;
+		AutoLock<PushLock> lock(Mutex);
+
+		const int i = _findProcessNode(pid);
+		if (i == INVALID_INDEX) {
+			return nullptr;
+		}
+		ProcessNode& n = Items[i];
+		if (n.rootPid != pid) {
+			return nullptr;
+		}
+		if (!n.rootWaiter) {
+			n.rootWaiter = NodeWaiter::create();
+			if (!n.rootWaiter) {
+				DbgPrint(DRIVER_PREFIX "[%d] Failed to create the waiter of the root process!\n", pid);
+				return nullptr;
+			}
+		}
+		n.rootWaiter->addRef();
+		return n.rootWaiter;
+	}
+
+	bool _copyPage(ULONG rootPid, ULONG cursor, ListPageHeader& header, void* data, size_t outBufSize, bool isFilesList)
+	{
+		::memset(&header, 0, sizeof(header));
+		if (0 == rootPid) return false;
+
+		AutoSharedLock<PushLock> lock(Mutex);
 
 		for (int i = 0; i < ItemCount; i++)
 		{
 			ProcessNode& n = Items[i];
-			if (n._containsProcess(pid1)) {
-				return true;
+			if (n.rootPid != rootPid) {
+				continue;
 			}
+			ULONG nextCursor = 0;
+			const size_t copied = (isFilesList) ? n._copyFilesPage(cursor, nextCursor, data, outBufSize) : n._copyProcessPage(cursor, nextCursor, data, outBufSize);
+			header.totalCount = ULONG((isFilesList) ? n._countFiles() : n._countProcesses());
+			header.itemCount = ULONG(copied);
+			header.generation = n.generation;
+			header.nextCursor = nextCursor;
+			return true;
 		}
 		return false;
 	}
 
+	int _findProcessNode(ULONG pid)
+	{
+		int nodeIndx = INVALID_INDEX;
+		if (!PidIndex.getItem(pid, nodeIndx)) {
+			return INVALID_INDEX;
+		}
+		return nodeIndx;
+	}
+
+	int _findFileNode(FileKey fileKey)
+	{
+		int nodeIndx = INVALID_INDEX;
+		if (!FileIndex.getItem(fileKey, nodeIndx)) {
+			return INVALID_INDEX;
+		}
+		return nodeIndx;
+	}
+
+	bool _ContainsProcess(ULONG pid1)
+	{
+		if (0 == pid1) return false;
+
+		return PidIndex.containsItem(pid1);
+	}
+
 	t_add_status _CanAddFile(ULONG parentPid)
 	{
 		if (0 == parentPid) {
 			return ADD_INVALID_ITEM;
 		}
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(parentPid)) {
-				if (n._canAddFile()) {
-					return ADD_OK;
-				}
-				return ADD_LIMIT_EXHAUSTED;
-			}
+		const int i = _findProcessNode(parentPid);
+		if (i == INVALID_INDEX) {
+			return ADD_NO_PARENT;
 		}
-		return ADD_NO_PARENT;
+		if (Items[i]._canAddFile()) {
+			return ADD_OK;
+		}
+		return ADD_LIMIT_EXHAUSTED;
 	}
 
-	t_add_status _addFile(LONGLONG fileId, ULONG parentPid)
+	t_add_status _addFile(FileKey fileKey, ULONG parentPid)
 	{
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(parentPid)) {
-				return n._addFile(fileId);
-			}
+		const int i = _findProcessNode(parentPid);
+		if (i == INVALID_INDEX) {
+			return ADD_INVALID_ITEM;
+		}
+		ProcessNode& n = Items[i];
+		const t_add_status status = n._addFile(fileKey);
+		if (status != ADD_OK) {
+			return status;
+		}
+		const t_add_status indexStatus = FileIndex.setItem(fileKey, i);
+		if (indexStatus != ADD_OK && indexStatus != ADD_ALREADY_EXIST) {
+			n._deleteFile(fileKey);
+			return ADD_LIMIT_EXHAUSTED;
 		}
-		return ADD_INVALID_ITEM;
+		_notify(n, NODE_EVENT_FILE_DROPPED, parentPid, fileKey);
+		return ADD_OK;
+	}
+
+	// adds the process to the given node, and keeps the PID index in sync
+	t_add_status _addProcessToNode(int i, ULONG pid)
+	{
+		const int prevNode = _findProcessNode(pid);
+		if (prevNode != INVALID_INDEX && prevNode != i) {
+			// the process is already watched within another tree
+			return ADD_ALREADY_EXIST;
+		}
+		ProcessNode& n = Items[i];
+		const t_add_status status = n._addProcess(pid);
+		if (status != ADD_OK) {
+			return status;
+		}
+		const t_add_status indexStatus = PidIndex.setItem(pid, i);
+		if (indexStatus != ADD_OK && indexStatus != ADD_ALREADY_EXIST) {
+			n._deleteProcess(pid);
+			return ADD_LIMIT_EXHAUSTED;
+		}
+		WatchedPids.setPid(pid);
+		_notify(n, (n.rootPid == pid) ? NODE_EVENT_NODE_CREATED : NODE_EVENT_PROCESS_ADDED, pid, FileKeys::invalidKey());
+		return ADD_OK;
 	}
 
 	typedef enum {
@@ -505,34 +888,34 @@ private:
 		DELETE_STATES_COUNT
 	} t_delete_status;
 
-	t_delete_status _deletePreviousFileAssociation(LONGLONG fileId, ULONG excludedPid)
+	t_delete_status _deletePreviousFileAssociation(FileKey fileKey, ULONG excludedPid)
 	{
-		if (FILE_INVALID_FILE_ID == fileId) {
+		if (!FileKeys::isValid(fileKey)) {
 			return DELETE_INVALID_ITEM;
 		}
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			// this file belongs to a dead node, delete the association first:
-			if (n._containsFile(fileId)) {
-				if (n._isDeadNode() && n._countProcesses() == 0) {
-					n._deleteFile(fileId);
-					_DestroyNodeIfEmpty(i);
-					return DELETE_OK;
-				}
-				if (excludedPid && n._containsProcess(excludedPid)) {
-					return DELETE_EXCLUDED; // file found in the excluded process, so deleting is not required
-				}
-				//this process tree is not dead
-				return DELETE_FORBIDDEN;
-			}
+		const int i = _findFileNode(fileKey);
+		if (i == INVALID_INDEX) {
+			return DELETE_NOT_FOUND;
+		}
+		ProcessNode& n = Items[i];
+		// this file belongs to a dead node, delete the association first:
+		if (n._isDeadNode() && n._countProcesses() == 0) {
+			n._deleteFile(fileKey);
+			FileIndex.deleteItem(fileKey);
+			_notify(n, NODE_EVENT_FILE_DELETED, 0, fileKey);
+			_DestroyNodeIfEmpty(i);
+			return DELETE_OK;
 		}
-		return DELETE_NOT_FOUND;
+		if (excludedPid && n._containsProcess(excludedPid)) {
+			return DELETE_EXCLUDED; // file found in the excluded process, so deleting is not required
+		}
+		//this process tree is not dead
+		return DELETE_FORBIDDEN;
 	}
 
 
-	t_add_status _createNewProcessNode(ULONG pid, LONGLONG imgFile, t_noresp respawnProtect)
+	t_add_status _createNewProcessNode(ULONG pid, FileKey imgFile, t_noresp respawnProtect)
 	{
 		//create a new node for the process:
 		ProcessNode* newItem = _getNewItemPtr();
@@ -543,8 +926,9 @@ private:
 		newItem->_init(pid, respawnProtect, imgFile);
 
 		//add root process to the list:
-		const t_add_status status = newItem->_addProcess(pid);
+		const t_add_status status = _addProcessToNode(ItemCount - 1, pid);
 		if (status == ADD_OK) {
+			InterlockedIncrement(&ActiveNodes);
 			return ADD_OK;
 		}
 		newItem->_destroy();
@@ -561,22 +945,10 @@ private:
 			return ADD_NO_PARENT;
 		}
 
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n.rootPid == parentPid) {
-				return n._addProcess(pid);
-			}
-		}
-
-		for (int i = 0; i < ItemCount; i++)
-		{
-			ProcessNode& n = Items[i];
-			if (n._containsProcess(parentPid)) {
-				return n._addProcess(pid);
-			}
+		const int i = _findProcessNode(parentPid);
+		if (i != INVALID_INDEX) {
+			return _addProcessToNode(i, pid);
 		}
-		
 		// this no parent tree found for such process
 		return ADD_NO_PARENT;
 	}
@@ -590,7 +962,6 @@ private:
 			ProcessNode& n = Items[i];
 			n._destroy();
 		}
-		deletionEvent.SetEvent();
 		return true;
 	}
 
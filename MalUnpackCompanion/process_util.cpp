@@ -134,32 +134,6 @@ NTSTATUS ProcessUtil::TerminateProcess(ULONG PID)
 
 ULONG ProcessUtil::GetProcessParentPID(const PEPROCESS Process)
 {
-	bool isCurrentProcess = false;
-	HANDLE hProcess = NULL;
-	NTSTATUS status = ProcessUtil::RetrieveProcessHandle(Process, isCurrentProcess, hProcess);
-	if (!NT_SUCCESS(status)) {
-		return false;
-	}
-
-	ULONG_PTR parentPID = 0;
-	__try
-	{
-		PROCESS_BASIC_INFORMATION pBasicInfo = { 0 };
-
-		ULONG retrunLen = 0;
-		const ULONG size = sizeof(PROCESS_BASIC_INFORMATION);
-		status = ZwQueryInformationProcess(hProcess, ProcessBasicInformation, &pBasicInfo, size, &retrunLen);
-		if (NT_SUCCESS(status) && (retrunLen == size)) {
-			parentPID = pBasicInfo.InheritedFromUniqueProcessId;
-			//DbgPrint(DRIVER_PREFIX "Process ParentID retrieved : [%p]\n", parentPID);
-		}
-		if (!isCurrentProcess) {
-			ZwClose(hProcess);
-		}
-	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		DbgPrint(DRIVER_PREFIX __FUNCTION__"failed with an exception");
-	}
-	return ULONG(parentPID);
+	// read directly from the EPROCESS: no need to open the handle, and to query the process
+	return HandleToULong(PsGetProcessInheritedFromUniqueProcessId(Process));
 }
@@ -0,0 +1,10 @@
+#pragma once
+
+// Common for the structures in the memory shared with the client (portable: no OS headers required).
+
+#if defined(_MSC_VER)
+	// MemoryBarrier is defined by both: <wdm.h> and <winnt.h>
+	#define SHARED_FENCE() MemoryBarrier()
+#else
+	#define SHARED_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
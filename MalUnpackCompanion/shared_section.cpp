@@ -0,0 +1,76 @@
+#include "shared_section.h"
+#include "common.h"
+
+#ifndef SEC_NO_CHANGE
+	#define SEC_NO_CHANGE 0x00400000
+#endif
+
+void SharedSection::init()
+{
+	section = NULL;
+	sectionObject = NULL;
+	systemView = NULL;
+}
+
+bool SharedSection::create(SIZE_T size)
+{
+	LARGE_INTEGER maxSize = { 0 };
+	maxSize.QuadPart = LONGLONG(size);
+
+	OBJECT_ATTRIBUTES attr;
+	InitializeObjectAttributes(&attr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+	NTSTATUS status = ZwCreateSection(&section, SECTION_ALL_ACCESS, &attr, &maxSize, PAGE_READWRITE, SEC_COMMIT, NULL);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint(DRIVER_PREFIX "Failed to create the section (0x%08X)\n", status);
+		section = NULL;
+		return false;
+	}
+	status = ObReferenceObjectByHandle(section, SECTION_MAP_READ | SECTION_MAP_WRITE, NULL, KernelMode, &sectionObject, NULL);
+	if (NT_SUCCESS(status)) {
+		SIZE_T viewSize = 0;
+		status = MmMapViewInSystemSpace(sectionObject, &systemView, &viewSize);
+	}
+	if (!NT_SUCCESS(status)) {
+		DbgPrint(DRIVER_PREFIX "Failed to map the section (0x%08X)\n", status);
+		systemView = NULL;
+		destroy();
+		return false;
+	}
+	// the pages of a new section are zeroed
+	return true;
+}
+
+void SharedSection::destroy()
+{
+	if (systemView) {
+		MmUnmapViewInSystemSpace(systemView);
+		systemView = NULL;
+	}
+	if (sectionObject) {
+		ObDereferenceObject(sectionObject);
+		sectionObject = NULL;
+	}
+	if (section) {
+		ZwClose(section);
+		section = NULL;
+	}
+}
+
+NTSTATUS SharedSection::mapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize)
+{
+	if (!section) {
+		return STATUS_NOT_SUPPORTED;
+	}
+	PVOID base = NULL;
+	SIZE_T size = 0;
+	// SEC_NO_CHANGE: the client cannot make the view writable (the driver keeps its own state outside of the section anyway)
+	NTSTATUS status = ZwMapViewOfSection(section, ZwCurrentProcess(), &base, 0, 0, NULL, &size, ViewUnmap, SEC_NO_CHANGE, PAGE_READONLY);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint(DRIVER_PREFIX "Failed to map the section into the client (0x%08X)\n", status);
+		return status;
+	}
+	baseAddress = reinterpret_cast<ULONGLONG>(base);
+	viewSize = size;
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <fltKernel.h>
+
+// A pagefile-backed section: written by the driver through its view in the system space,
+// and mapped read-only into the client on request. The driver must not trust anything it reads back from the section.
+
+struct SharedSection
+{
+public:
+	void init();
+
+	bool create(SIZE_T size);
+
+	// the views mapped by the clients remain valid, until they unmap them
+	void destroy();
+
+	PVOID getView() { return systemView; }
+
+	// maps the section read-only into the current process
+	NTSTATUS mapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize);
+
+private:
+	HANDLE section;
+	PVOID sectionObject;
+	PVOID systemView;
+};
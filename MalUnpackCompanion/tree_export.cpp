@@ -0,0 +1,200 @@
+#include "tree_export.h"
+#include "shared_section.h"
+#include "file_key.h"
+
+// The state of a snapshot, kept in the driver's memory: the bounds of the lists are never read back from the section,
+// that the client may have modified. (The items themselves are read back only to find the one to be removed:
+// a tampered item can spoil only the view of the client.)
+struct TreeSlot
+{
+	ULONG rootPid; // 0: the slot is free
+	ULONG processCount;
+	ULONG fileCount;
+	ULONG flags;
+	ULONGLONG seq;
+};
+
+namespace TreeExport {
+	SharedSection g_Section;
+	TreeSnapshotHeader* g_Header = NULL; // the view in the system space
+	TreeSlot* g_Slots = NULL; // the private state of each of the TREE_SNAPSHOT_MAX_TREES snapshots
+	ULONGLONG g_Generation = 0;
+	ItemsSet<ULONG> g_MissedRoots; // the roots of the watched trees that currently have no slot
+
+	int _findSlot(ULONG rootPid)
+	{
+		for (int i = 0; i < TREE_SNAPSHOT_MAX_TREES; i++) {
+			if (g_Slots[i].rootPid == rootPid) {
+				return i;
+			}
+		}
+		return INVALID_INDEX;
+	}
+
+	void _addPid(TreeSlot& slot, TreeSnapshot& tree, ULONG pid)
+	{
+		if (slot.processCount >= TREE_SNAPSHOT_MAX_PROCESSES) {
+			slot.flags |= TREE_SNAPSHOT_TRUNCATED;
+			return;
+		}
+		tree.pids[slot.processCount++] = pid;
+	}
+
+	void _removePid(TreeSlot& slot, TreeSnapshot& tree, ULONG pid)
+	{
+		for (ULONG i = 0; i < slot.processCount; i++) {
+			if (tree.pids[i] == pid) {
+				// the order does not matter, so the last one takes the freed place:
+				tree.pids[i] = tree.pids[--slot.processCount];
+				return;
+			}
+		}
+	}
+
+	inline bool _isSameFile(const TreeSnapshotFile& file, const FileKey& fileKey)
+	{
+		return file.fileIdLow == fileKey.FileIdLow
+			&& file.fileIdHigh == fileKey.FileIdHigh
+			&& file.volumeSerial == fileKey.VolumeSerial;
+	}
+
+	void _addFile(TreeSlot& slot, TreeSnapshot& tree, const FileKey& fileKey)
+	{
+		if (slot.fileCount >= TREE_SNAPSHOT_MAX_FILES) {
+			slot.flags |= TREE_SNAPSHOT_TRUNCATED;
+			return;
+		}
+		TreeSnapshotFile& file = tree.files[slot.fileCount++];
+		file.volumeSerial = fileKey.VolumeSerial;
+		file.fileIdLow = fileKey.FileIdLow;
+		file.fileIdHigh = fileKey.FileIdHigh;
+	}
+
+	void _removeFile(TreeSlot& slot, TreeSnapshot& tree, const FileKey& fileKey)
+	{
+		for (ULONG i = 0; i < slot.fileCount; i++) {
+			if (_isSameFile(tree.files[i], fileKey)) {
+				tree.files[i] = tree.files[--slot.fileCount];
+				return;
+			}
+		}
+	}
+
+	void _resetSlot(TreeSlot& slot, ULONG rootPid)
+	{
+		slot.rootPid = rootPid;
+		slot.processCount = 0;
+		slot.fileCount = 0;
+		slot.flags = 0;
+	}
+
+	// copies the private state of the slot to the snapshot
+	void _publish(const TreeSlot& slot, TreeSnapshot& tree)
+	{
+		tree.rootPid = slot.rootPid;
+		tree.processCount = slot.processCount;
+		tree.fileCount = slot.fileCount;
+		tree.flags = slot.flags;
+	}
+
+	void _publishMissed()
+	{
+		g_Header->missedTrees = ULONG(g_MissedRoots.countItems());
+		SHARED_FENCE();
+		g_Header->generation = ++g_Generation;
+	}
+};
+
+bool TreeExport::Init()
+{
+	g_Section.init();
+	g_Generation = 0;
+	g_MissedRoots.init();
+	g_Slots = AllocBuffer<TreeSlot>(TREE_SNAPSHOT_MAX_TREES, true, NonPagedPool);
+	if (!g_Slots) {
+		return false;
+	}
+	if (!g_Section.create(SIZE_T(TreeSnapshots::sizeFor(TREE_SNAPSHOT_MAX_TREES)))) {
+		Destroy();
+		return false;
+	}
+	g_Header = static_cast<TreeSnapshotHeader*>(g_Section.getView());
+	if (!TreeSnapshots::init(g_Header, TREE_SNAPSHOT_MAX_TREES)) {
+		Destroy();
+		return false;
+	}
+	return true;
+}
+
+void TreeExport::Destroy()
+{
+	g_Header = NULL;
+	g_Section.destroy();
+	FreeBuffer<TreeSlot>(g_Slots, TREE_SNAPSHOT_MAX_TREES);
+	g_Slots = NULL;
+	g_MissedRoots.destroy();
+}
+
+void TreeExport::Update(const NodeEvent& evt)
+{
+	if (!g_Header || !evt.rootPid) return;
+
+	int slotIndx = _findSlot(evt.rootPid);
+	if (slotIndx == INVALID_INDEX) {
+		if (evt.type == NODE_EVENT_TREE_EMPTY) {
+			if (g_MissedRoots.deleteItem(evt.rootPid)) {
+				_publishMissed();
+			}
+			return;
+		}
+		// the tree takes a free slot, also if it missed one before:
+		slotIndx = _findSlot(0);
+		if (slotIndx == INVALID_INDEX) {
+			if (g_MissedRoots.addItem(evt.rootPid) == ADD_OK) {
+				_publishMissed();
+			}
+			return;
+		}
+		_resetSlot(g_Slots[slotIndx], evt.rootPid);
+		if (evt.type != NODE_EVENT_NODE_CREATED) {
+			// the events from before the claim are lost: the snapshot lists only what was added since
+			g_Slots[slotIndx].flags |= TREE_SNAPSHOT_TRUNCATED;
+		}
+		if (g_MissedRoots.deleteItem(evt.rootPid)) {
+			g_Header->missedTrees = ULONG(g_MissedRoots.countItems()); // published along with the tree
+		}
+	}
+	TreeSlot& slot = g_Slots[slotIndx];
+	TreeSnapshot& tree = TreeSnapshots::trees(g_Header)[slotIndx];
+
+	TreeSnapshots::beginWrite(tree, slot.seq);
+	switch (evt.type) {
+		case NODE_EVENT_NODE_CREATED:
+			_resetSlot(slot, evt.rootPid);
+			_addPid(slot, tree, evt.pid);
+			break;
+		case NODE_EVENT_PROCESS_ADDED:
+			_addPid(slot, tree, evt.pid);
+			break;
+		case NODE_EVENT_ROOT_DELETED:
+		case NODE_EVENT_PROCESS_DELETED:
+			_removePid(slot, tree, evt.pid);
+			break;
+		case NODE_EVENT_FILE_DROPPED:
+			_addFile(slot, tree, evt.fileKey);
+			break;
+		case NODE_EVENT_FILE_DELETED:
+			_removeFile(slot, tree, evt.fileKey);
+			break;
+		case NODE_EVENT_TREE_EMPTY:
+			_resetSlot(slot, 0);
+			break;
+	}
+	_publish(slot, tree);
+	TreeSnapshots::endWrite(g_Header, tree, slot.seq, g_Generation);
+}
+
+NTSTATUS TreeExport::MapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize)
+{
+	return g_Section.mapIntoCurrentProcess(baseAddress, viewSize);
+}
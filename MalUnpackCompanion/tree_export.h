@@ -0,0 +1,21 @@
+#pragma once
+
+#include <fltKernel.h>
+#include "common.h"
+#include "tree_snapshot.h"
+
+// Exports the snapshots of the watched trees into a section that the client maps read-only,
+// so that it can read the lists in place, instead of querying them by the IOCTLs.
+
+namespace TreeExport {
+
+    bool Init();
+
+    void Destroy();
+
+    // applies the change to the snapshot of the tree; to be called serialized (by the lock of the data layer)
+    void Update(const NodeEvent& evt);
+
+    // maps the snapshots read-only into the current process
+    NTSTATUS MapIntoCurrentProcess(ULONGLONG& baseAddress, ULONGLONG& viewSize);
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "shared_mem.h"
+
+// The snapshots of the watched trees (their PIDs and files), in the memory shared with the client.
+// Portable (no OS headers required): included by the driver and by the client.
+// Each tree is guarded by its own seqlock: the driver (the single writer) keeps the sequence odd while modifying the tree,
+// the client reads the tree in place, and retries if the sequence changed meanwhile.
+
+#define TREE_SNAPSHOT_MAGIC 0x544E554D // "MUNT"
+#define TREE_SNAPSHOT_VERSION 1
+
+#define TREE_SNAPSHOT_MAX_TREES 64
+#define TREE_SNAPSHOT_MAX_PROCESSES 1024
+#define TREE_SNAPSHOT_MAX_FILES 1024
+
+// the snapshot is incomplete: the tree has more items than fit in it, or it got the slot only after some of its events
+// were lost (see: missedTrees); the complete lists must be queried by the IOCTLs
+#define TREE_SNAPSHOT_TRUNCATED 1
+
+struct TreeSnapshotFile {
+	unsigned long long volumeSerial; // the layout of the FileKey
+	unsigned long long fileIdLow;
+	unsigned long long fileIdHigh;
+};
+
+struct TreeSnapshot {
+	volatile unsigned long long seq; // odd: the snapshot is being modified
+	unsigned int rootPid; // 0: the slot is free
+	unsigned int processCount;
+	unsigned int fileCount;
+	unsigned int flags;
+	unsigned int pids[TREE_SNAPSHOT_MAX_PROCESSES];
+	TreeSnapshotFile files[TREE_SNAPSHOT_MAX_FILES];
+};
+
+struct TreeSnapshotHeader {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int maxTrees;
+	unsigned int treeSize; // sizeof(TreeSnapshot)
+	volatile unsigned long long generation; // incremented on each change of any tree: there is nothing to re-read if it did not change
+	volatile unsigned int missedTrees; // the watched trees that currently have no slot (on its next event after a slot is freed, it takes it, marked as truncated)
+	unsigned int reserved[9];
+};
+
+namespace TreeSnapshots {
+
+	inline TreeSnapshot* trees(TreeSnapshotHeader* hdr)
+	{
+		return reinterpret_cast<TreeSnapshot*>(hdr + 1);
+	}
+
+	inline const TreeSnapshot* trees(const TreeSnapshotHeader* hdr)
+	{
+		return reinterpret_cast<const TreeSnapshot*>(hdr + 1);
+	}
+
+	inline unsigned long long sizeFor(unsigned int maxTrees)
+	{
+		return sizeof(TreeSnapshotHeader) + (unsigned long long)maxTrees * sizeof(TreeSnapshot);
+	}
+
+	// writer: prepares the zeroed memory of (at least) sizeFor(maxTrees) bytes
+	inline bool init(TreeSnapshotHeader* hdr, unsigned int maxTrees)
+	{
+		if (!hdr || maxTrees == 0) {
+			return false;
+		}
+		hdr->maxTrees = maxTrees;
+		hdr->treeSize = sizeof(TreeSnapshot);
+		hdr->generation = 0;
+		hdr->missedTrees = 0;
+		hdr->version = TREE_SNAPSHOT_VERSION;
+		SHARED_FENCE();
+		hdr->magic = TREE_SNAPSHOT_MAGIC;
+		return true;
+	}
+
+	// reader: checks if the snapshots are compatible
+	inline bool isValid(const TreeSnapshotHeader* hdr)
+	{
+		if (!hdr || hdr->magic != TREE_SNAPSHOT_MAGIC || hdr->version != TREE_SNAPSHOT_VERSION) {
+			return false;
+		}
+		return hdr->treeSize == sizeof(TreeSnapshot) && hdr->maxTrees != 0;
+	}
+
+	// writer: seq is the private copy of the sequence of the tree (the writer never reads back the shared one)
+	inline void beginWrite(TreeSnapshot& tree, unsigned long long& seq)
+	{
+		seq++;
+		tree.seq = seq;
+		SHARED_FENCE();
+	}
+
+	// writer: generation is the private copy of the generation of the snapshots
+	inline void endWrite(TreeSnapshotHeader* hdr, TreeSnapshot& tree, unsigned long long& seq, unsigned long long& generation)
+	{
+		SHARED_FENCE();
+		seq++;
+		tree.seq = seq;
+		generation++;
+		hdr->generation = generation;
+	}
+
+	// reader: returns the sequence to be passed to readValidate, after reading the tree in place
+	inline unsigned long long readBegin(const TreeSnapshot& tree)
+	{
+		unsigned long long seq = tree.seq;
+		while (seq & 1) {
+			seq = tree.seq;
+		}
+		SHARED_FENCE();
+		return seq;
+	}
+
+	// reader: false means that the tree was modified during the read, so it must be read again
+	inline bool readValidate(const TreeSnapshot& tree, unsigned long long seq)
+	{
+		SHARED_FENCE();
+		return tree.seq == seq;
+	}
+};
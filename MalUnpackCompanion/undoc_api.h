@@ -18,3 +18,6 @@ extern "C" NTSTATUS ZwSetInformationProcess(
 	_In_      ULONG            ProcessInformationLength
 );
 
+extern "C" HANDLE PsGetProcessInheritedFromUniqueProcessId(
+	_In_      PEPROCESS        Process
+);
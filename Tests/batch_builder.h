@@ -0,0 +1,42 @@
+#pragma once
+
+// Builds the input of IOCTL_MUNPACK_COMPANION_BATCH, in the format described in batch.h.
+
+#include "batch.h"
+
+#include <string.h>
+#include <vector>
+
+struct BatchBuilder
+{
+	BatchBuilder(unsigned int flags = 0)
+	{
+		BatchHeader hdr = { 0, flags };
+		_append(&hdr, sizeof(hdr));
+	}
+
+	void addCommand(unsigned int ioctl, const void* input, unsigned int inputSize, unsigned int outputSize)
+	{
+		BatchCommand cmd = { ioctl, inputSize, outputSize, 0 };
+		_append(&cmd, sizeof(cmd));
+		_append(input, inputSize);
+		buf.resize(size_t(Batch::alignUp(buf.size())), 0);
+		header()->count++;
+	}
+
+	BatchHeader* header()
+	{
+		return reinterpret_cast<BatchHeader*>(buf.data());
+	}
+
+	std::vector<unsigned char> buf;
+
+private:
+	void _append(const void* data, size_t size)
+	{
+		if (!size) return;
+		const size_t offset = buf.size();
+		buf.resize(offset + size);
+		::memcpy(&buf[offset], data, size);
+	}
+};
@@ -0,0 +1,187 @@
+// Batch::measure and Batch::next over arbitrary input: the parser must never step outside of the buffer,
+// and a batch accepted by measure must be walked by next in the same way as the driver does (see: _RunBatchCommands).
+//
+// Built with libFuzzer (-DUSE_LIBFUZZER=ON, clang only) it is driven by the fuzzer,
+// otherwise main runs the given corpus files, then the mutations of random valid batches.
+
+#include "batch_builder.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <random>
+#include <vector>
+
+#define FUZZ_ITERATIONS 200000
+
+static int g_Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("[!] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		g_Failures++; \
+	} \
+} while (0)
+
+static void checkBatch(const unsigned char* buf, size_t size)
+{
+	unsigned long long outputSize = 0;
+	unsigned long long maxCommandBuffer = 0;
+	const bool isValid = Batch::measure(buf, size, outputSize, maxCommandBuffer);
+
+	BatchHeader hdr = { 0 };
+	BatchCursor cursor = { 0 };
+	if (Batch::begin(buf, size, hdr, cursor) != BATCH_PARSE_OK) {
+		CHECK(!isValid);
+		return;
+	}
+	CHECK(cursor.count <= BATCH_MAX_COMMANDS);
+
+	// walk the batch again, checking each command, and measuring it independently:
+	unsigned long long expectedOutput = sizeof(BatchHeader);
+	unsigned long long expectedMax = 0;
+	BatchCommand cmd = { 0 };
+	const unsigned char* input = nullptr;
+	t_batch_parse status = BATCH_PARSE_OK;
+	unsigned int parsed = 0;
+	while ((status = Batch::next(cursor, cmd, input)) == BATCH_PARSE_OK) {
+		parsed++;
+		CHECK(parsed <= hdr.count);
+		CHECK(cmd.outputSize <= BATCH_MAX_OUTPUT);
+		CHECK((input == nullptr) == (cmd.inputSize == 0));
+		if (input) {
+			CHECK(input >= buf + sizeof(BatchHeader) + sizeof(BatchCommand));
+			CHECK(input + cmd.inputSize <= buf + size);
+		}
+		expectedOutput += sizeof(BatchResult) + Batch::alignUp(cmd.outputSize);
+		const unsigned long long cmdBuffer = (cmd.inputSize > cmd.outputSize) ? cmd.inputSize : cmd.outputSize;
+		if (cmdBuffer > expectedMax) expectedMax = cmdBuffer;
+	}
+	CHECK(status == BATCH_PARSE_END || status == BATCH_PARSE_MALFORMED);
+	if (status == BATCH_PARSE_END) {
+		CHECK(parsed == hdr.count);
+	}
+	if (!isValid) {
+		CHECK(status == BATCH_PARSE_MALFORMED || expectedOutput > BATCH_MAX_OUTPUT);
+		return;
+	}
+	CHECK(status == BATCH_PARSE_END);
+	CHECK(outputSize == expectedOutput);
+	CHECK(maxCommandBuffer == expectedMax);
+	CHECK(outputSize <= BATCH_MAX_OUTPUT);
+
+	// as the driver: each command fits in the buffer of maxCommandBuffer, and each result in the output of outputSize
+	std::vector<unsigned char> cmdBuf(size_t(maxCommandBuffer) + 1);
+	unsigned long long outOffset = sizeof(BatchHeader);
+	Batch::begin(buf, size, hdr, cursor);
+	while (Batch::next(cursor, cmd, input) == BATCH_PARSE_OK) {
+		CHECK(cmd.inputSize <= maxCommandBuffer && cmd.outputSize <= maxCommandBuffer);
+		if (input && cmd.inputSize <= maxCommandBuffer) {
+			::memcpy(cmdBuf.data(), input, cmd.inputSize);
+		}
+		CHECK(outOffset + sizeof(BatchResult) + cmd.outputSize <= outputSize);
+		outOffset += sizeof(BatchResult) + Batch::alignUp(cmd.outputSize);
+	}
+	CHECK(outOffset == outputSize);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	// the exact copy, so that reading past its end is caught by the sanitizers:
+	unsigned char* buf = static_cast<unsigned char*>(::malloc(size ? size : 1));
+	if (size) ::memcpy(buf, data, size);
+	checkBatch(buf, size);
+	::free(buf);
+#ifdef USE_LIBFUZZER
+	if (g_Failures) {
+		::abort(); // report the input to the fuzzer
+	}
+#endif
+	return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+static const unsigned int g_Extremes[] = { 0, 1, 7, 8, BATCH_MAX_COMMANDS, BATCH_MAX_COMMANDS + 1,
+	BATCH_MAX_INPUT, BATCH_MAX_OUTPUT, BATCH_MAX_OUTPUT + 1, 0x7FFFFFFF, 0xFFFFFFF8, 0xFFFFFFFF };
+
+static std::vector<unsigned char> makeBatch(std::mt19937& rng)
+{
+	BatchBuilder batch(rng() % 2);
+	const unsigned int count = rng() % (BATCH_MAX_COMMANDS + 2);
+	std::vector<unsigned char> input;
+	for (unsigned int i = 0; i < count; i++) {
+		input.resize(rng() % 64);
+		for (unsigned char& b : input) b = (unsigned char)rng();
+		const unsigned int outputSize = (rng() % 8) ? (rng() % 0x1000) : (rng() % (BATCH_MAX_OUTPUT / 8));
+		batch.addCommand(rng(), input.data(), (unsigned int)input.size(), outputSize);
+	}
+	return batch.buf;
+}
+
+static void mutate(std::vector<unsigned char>& buf, std::mt19937& rng)
+{
+	const size_t mutations = rng() % 4;
+	for (size_t m = 0; m < mutations && !buf.empty(); m++) {
+		switch (rng() % 4) {
+		case 0: // flip a byte
+			buf[rng() % buf.size()] ^= (unsigned char)(1 + rng() % 255);
+			break;
+		case 1: // truncate
+			buf.resize(rng() % buf.size());
+			break;
+		case 2: // append the garbage
+			for (size_t i = rng() % 32; i > 0; i--) buf.push_back((unsigned char)rng());
+			break;
+		default: // put an extreme value into one of the fields
+			if (buf.size() >= sizeof(unsigned int)) {
+				const size_t offset = (rng() % (buf.size() / sizeof(unsigned int))) * sizeof(unsigned int);
+				const unsigned int val = g_Extremes[rng() % (sizeof(g_Extremes) / sizeof(g_Extremes[0]))];
+				::memcpy(&buf[offset], &val, sizeof(val));
+			}
+			break;
+		}
+	}
+}
+
+static bool runFile(const char* path)
+{
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		printf("[!] cannot open: %s\n", path);
+		return false;
+	}
+	std::vector<unsigned char> data;
+	int c = 0;
+	while ((c = fgetc(fp)) != EOF) data.push_back((unsigned char)c);
+	fclose(fp);
+	LLVMFuzzerTestOneInput(data.data(), data.size());
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++) {
+		if (!runFile(argv[i])) g_Failures++;
+	}
+	std::mt19937 rng(0x6261);
+	size_t accepted = 0;
+	for (size_t i = 0; i < FUZZ_ITERATIONS; i++) {
+		std::vector<unsigned char> buf;
+		if (i % 16) {
+			buf = makeBatch(rng);
+			mutate(buf, rng);
+		}
+		else {
+			buf.resize(rng() % 256);
+			for (unsigned char& b : buf) b = (unsigned char)rng();
+		}
+		unsigned long long outputSize = 0, maxCommandBuffer = 0;
+		if (Batch::measure(buf.data(), buf.size(), outputSize, maxCommandBuffer)) accepted++;
+		LLVMFuzzerTestOneInput(buf.data(), buf.size());
+	}
+	printf("batch fuzz: %zu inputs (%zu accepted): %s\n", size_t(FUZZ_ITERATIONS), accepted, g_Failures ? "FAILED" : "OK");
+	return (g_Failures == 0) ? 0 : 1;
+}
+
+#endif // USE_LIBFUZZER
@@ -0,0 +1,125 @@
+// IOCTL_MUNPACK_COMPANION_BATCH vs the same requests sent one by one: the results must be the same,
+// and the batch should take a fraction of the time (one round trip instead of several).
+// Windows only: needs the driver to be loaded.
+
+#include <windows.h>
+#include <winioctl.h>
+
+#include "common.h"
+#include "batch_builder.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+#define ROUNDS 20000
+#define VERSION_MAX 64
+#define PAGE_ITEMS 16
+
+struct ProcessPage {
+	ListPageHeader header;
+	ULONG pids[PAGE_ITEMS];
+};
+
+static int g_Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("[!] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		g_Failures++; \
+	} \
+} while (0)
+
+// the outputs of the requests, as returned by the driver:
+struct Outputs {
+	char version[VERSION_MAX];
+	ULONG nodesCount;
+	ProcessPage page;
+	bool isPageOk;
+};
+
+static bool sendIoctl(HANDLE hDevice, DWORD ioctl, const void* input, DWORD inputSize, void* output, DWORD outputSize, DWORD& outLen)
+{
+	outLen = 0;
+	return DeviceIoControl(hDevice, ioctl, const_cast<void*>(input), inputSize, output, outputSize, &outLen, NULL) != FALSE;
+}
+
+static void querySingle(HANDLE hDevice, const ListPageRequest& pageReq, Outputs& out)
+{
+	DWORD outLen = 0;
+	::memset(&out, 0, sizeof(out));
+	sendIoctl(hDevice, IOCTL_MUNPACK_COMPANION_VERSION, NULL, 0, out.version, sizeof(out.version), outLen);
+	sendIoctl(hDevice, IOCTL_MUNPACK_COMPANION_COUNT_NODES, NULL, 0, &out.nodesCount, sizeof(out.nodesCount), outLen);
+	out.isPageOk = sendIoctl(hDevice, IOCTL_MUNPACK_COMPANION_LIST_PROCESSES_PAGED, &pageReq, sizeof(pageReq), &out.page, sizeof(out.page), outLen);
+}
+
+static bool queryBatch(HANDLE hDevice, const std::vector<unsigned char>& batch, std::vector<unsigned char>& results, Outputs& out)
+{
+	::memset(&out, 0, sizeof(out));
+	DWORD outLen = 0;
+	if (!sendIoctl(hDevice, IOCTL_MUNPACK_COMPANION_BATCH, batch.data(), DWORD(batch.size()), results.data(), DWORD(results.size()), outLen)) {
+		return false;
+	}
+	const BatchHeader* hdr = reinterpret_cast<const BatchHeader*>(results.data());
+	if (hdr->count != 3) {
+		return false;
+	}
+	void* outputs[] = { out.version, &out.nodesCount, &out.page };
+	size_t offset = sizeof(BatchHeader);
+	for (unsigned int i = 0; i < hdr->count; i++) {
+		const BatchResult* result = reinterpret_cast<const BatchResult*>(&results[offset]);
+		::memcpy(outputs[i], &results[offset + sizeof(BatchResult)], result->outputSize);
+		if (i == 2) {
+			out.isPageOk = (result->status >= 0);
+		}
+		offset += sizeof(BatchResult) + size_t(Batch::alignUp(result->capacity));
+	}
+	return true;
+}
+
+int main()
+{
+	HANDLE hDevice = CreateFileW(L"\\\\.\\" MY_DEVICE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		printf("[!] cannot open the device (is the driver loaded?), error: %lu\n", GetLastError());
+		return 1;
+	}
+	// the paged list of the own tree: fails (STATUS_NOT_FOUND) if the process is not watched, which is compared all the same
+	ListPageRequest pageReq = { GetCurrentProcessId(), 0 };
+
+	BatchBuilder batch;
+	batch.addCommand(IOCTL_MUNPACK_COMPANION_VERSION, NULL, 0, VERSION_MAX);
+	batch.addCommand(IOCTL_MUNPACK_COMPANION_COUNT_NODES, NULL, 0, sizeof(ULONG));
+	batch.addCommand(IOCTL_MUNPACK_COMPANION_LIST_PROCESSES_PAGED, &pageReq, sizeof(pageReq), sizeof(ProcessPage));
+
+	unsigned long long resultsSize = 0, maxCommandBuffer = 0;
+	CHECK(Batch::measure(batch.buf.data(), batch.buf.size(), resultsSize, maxCommandBuffer));
+	std::vector<unsigned char> results(size_t(resultsSize));
+
+	Outputs single, batched;
+	querySingle(hDevice, pageReq, single);
+	CHECK(queryBatch(hDevice, batch.buf, results, batched));
+	CHECK(::memcmp(single.version, batched.version, sizeof(single.version)) == 0);
+	CHECK(single.nodesCount == batched.nodesCount);
+	CHECK(single.isPageOk == batched.isPageOk);
+	CHECK(::memcmp(&single.page, &batched.page, sizeof(single.page)) == 0);
+	printf("driver: %s, trees: %lu\n", single.version, single.nodesCount);
+
+	typedef std::chrono::steady_clock Clock;
+	auto t0 = Clock::now();
+	for (size_t i = 0; i < ROUNDS; i++) {
+		querySingle(hDevice, pageReq, single);
+	}
+	auto t1 = Clock::now();
+	for (size_t i = 0; i < ROUNDS; i++) {
+		queryBatch(hDevice, batch.buf, results, batched);
+	}
+	auto t2 = Clock::now();
+	const double singleUs = std::chrono::duration<double, std::micro>(t1 - t0).count() / ROUNDS;
+	const double batchUs = std::chrono::duration<double, std::micro>(t2 - t1).count() / ROUNDS;
+	printf("3 requests: single: %.2f us, batch: %.2f us, ratio: %.2f\n", singleUs, batchUs, singleUs / batchUs);
+
+	CloseHandle(hDevice);
+	printf("round trip: %s\n", g_Failures ? "FAILED" : "OK");
+	return (g_Failures == 0) ? 0 : 1;
+}
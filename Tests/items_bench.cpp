@@ -0,0 +1,253 @@
+// ItemsList: the hash set vs the sorted array that it replaced, at the sizes typical for the watched trees.
+
+#include "data_structs.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#define ROUNDS_ITEMS 400000 // the number of the items processed per measurement, whatever the size of the list
+
+// The previous implementation of the ItemsList (sorted array, binary search, shifting on add/delete), kept as the baseline:
+
+template<typename T, typename TLock>
+struct SortedItemsList
+{
+public:
+	void init()
+	{
+		Mutex.Init();
+		ItemCount = 0;
+		MaxItemCount = 0;
+		Items = NULL;
+	}
+
+	bool initItems(int maxNum = MAX_ITEMS)
+	{
+		return _initItems(maxNum);
+	}
+
+	bool destroy()
+	{
+		AutoLock<TLock> lock(Mutex);
+		return _destroyItems();
+	}
+
+	t_add_status addItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		if (Items == NULL) {
+			if (!_initItems()) {
+				return ADD_UNINITIALIZED;
+			}
+		}
+		if (ItemCount >= MaxItemCount) {
+			return ADD_LIMIT_EXHAUSTED;
+		}
+		if (_getItemIndex(it) != INVALID_INDEX) {
+			return ADD_ALREADY_EXIST;
+		}
+		if (_addItemSorted(it)) {
+			return ADD_OK;
+		}
+		return ADD_LIMIT_EXHAUSTED;
+	}
+
+	bool containsItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		return _getItemIndex(it) != INVALID_INDEX;
+	}
+
+	bool deleteItem(T it)
+	{
+		AutoLock<TLock> lock(Mutex);
+		int index = _getItemIndex(it);
+		if (index == INVALID_INDEX) {
+			return false;
+		}
+		if (!_shiftItemsLeft(index)) {
+			return false;
+		}
+		if (ItemCount == 0) {
+			_destroyItems();
+		}
+		return true;
+	}
+
+private:
+	T* Items;
+	int ItemCount;
+	int MaxItemCount;
+	TLock Mutex;
+
+	bool _initItems(int maxNum = MAX_ITEMS)
+	{
+		if (Items) {
+			return true;
+		}
+		ItemCount = 0;
+		Items = AllocBuffer<T>(maxNum + 1);
+		if (Items != NULL) {
+			MaxItemCount = maxNum;
+			return true;
+		}
+		return false;
+	}
+
+	bool _destroyItems()
+	{
+		if (!Items) {
+			return false;
+		}
+		FreeBuffer<T>(Items, MaxItemCount);
+		ItemCount = 0;
+		MaxItemCount = 0;
+		Items = NULL;
+		return true;
+	}
+
+	int _getItemIndex(T it)
+	{
+		if (!Items || ItemCount == 0) {
+			return INVALID_INDEX;
+		}
+		int start = 0;
+		int stop = ItemCount;
+		while (start < stop) {
+			int mIndx = (start + stop) / 2;
+			if (Items[mIndx] == it) {
+				return mIndx;
+			}
+			if (Items[mIndx] < it) {
+				start = mIndx + 1;
+			}
+			else {
+				stop = mIndx;
+			}
+		}
+		return INVALID_INDEX;
+	}
+
+	int _findFirstGreater(T it)
+	{
+		for (int i = 0; i < ItemCount; i++) {
+			if (Items[i] > it) {
+				return i;
+			}
+		}
+		return ItemCount;
+	}
+
+	bool _shiftItemsLeft(int startIndx)
+	{
+		for (int i = startIndx + 1; i < ItemCount; i++) {
+			Items[i - 1] = Items[i];
+		}
+		Items[ItemCount - 1] = 0;
+		ItemCount--;
+		return true;
+	}
+
+	bool _addItemSorted(T it)
+	{
+		const int indx = _findFirstGreater(it);
+		for (int i = ItemCount; i > indx; i--) {
+			Items[i] = Items[i - 1];
+		}
+		Items[indx] = it;
+		ItemCount++;
+		return true;
+	}
+};
+
+///
+
+struct Timings {
+	double addNs;
+	double lookupNs;
+	double deleteNs;
+};
+
+template<typename TList, typename T>
+Timings measure(const std::vector<T>& items, const std::vector<T>& queries, const std::vector<T>& deletions, size_t& checksum)
+{
+	typedef std::chrono::steady_clock Clock;
+	const size_t rounds = (ROUNDS_ITEMS / items.size()) + 1;
+	double addTime = 0, lookupTime = 0, deleteTime = 0;
+
+	for (size_t r = 0; r < rounds; r++) {
+		TList list;
+		list.init();
+		list.initItems();
+
+		auto t0 = Clock::now();
+		for (const T& it : items) {
+			list.addItem(it);
+		}
+		auto t1 = Clock::now();
+		for (const T& it : queries) {
+			if (list.containsItem(it)) checksum++;
+		}
+		auto t2 = Clock::now();
+		for (const T& it : deletions) {
+			list.deleteItem(it);
+		}
+		auto t3 = Clock::now();
+		list.destroy();
+
+		addTime += std::chrono::duration<double, std::nano>(t1 - t0).count();
+		lookupTime += std::chrono::duration<double, std::nano>(t2 - t1).count();
+		deleteTime += std::chrono::duration<double, std::nano>(t3 - t2).count();
+	}
+	Timings t;
+	t.addNs = addTime / (double(rounds) * items.size());
+	t.lookupNs = lookupTime / (double(rounds) * queries.size());
+	t.deleteNs = deleteTime / (double(rounds) * deletions.size());
+	return t;
+}
+
+template<typename T>
+void compare(const char* typeName, T step, size_t count)
+{
+	std::mt19937_64 rng(count);
+	// the items come in the random order (as the PIDs and file IDs assigned by the system), the half of the queries misses:
+	std::vector<T> items;
+	for (size_t i = 1; i <= count; i++) {
+		items.push_back(T(i) * step);
+	}
+	std::shuffle(items.begin(), items.end(), rng);
+	std::vector<T> queries;
+	for (size_t i = 0; i < count * 2; i++) {
+		queries.push_back((i % 2) ? items[i / 2] : T(count + i + 1) * step);
+	}
+	std::vector<T> deletions(items);
+	std::shuffle(deletions.begin(), deletions.end(), rng);
+
+	size_t sortedHits = 0, hashHits = 0;
+	const Timings sorted = measure<SortedItemsList<T, NoLock> >(items, queries, deletions, sortedHits);
+	const Timings hashed = measure<ItemsList<T, NoLock> >(items, queries, deletions, hashHits);
+	if (sortedHits != hashHits) {
+		printf("[!] %s/%zu: the results differ!\n", typeName, count);
+	}
+	printf("%-9s %6zu | %8.1f %8.1f %8.1f | %8.1f %8.1f %8.1f\n", typeName, count,
+		sorted.addNs, sorted.lookupNs, sorted.deleteNs,
+		hashed.addNs, hashed.lookupNs, hashed.deleteNs);
+}
+
+int main()
+{
+	const size_t sizes[] = { 16, 256, 1024 };
+
+	printf("%-16s | %-26s | %-26s\n", "", "sorted array [ns/op]", "hash set [ns/op]");
+	printf("%-9s %6s | %8s %8s %8s | %8s %8s %8s\n", "type", "items", "add", "lookup", "delete", "add", "lookup", "delete");
+	for (size_t count : sizes) {
+		compare<ULONG>("PID", 4, count);
+	}
+	for (size_t count : sizes) {
+		compare<LONGLONG>("FileId", 0x10000000003LL, count);
+	}
+	return 0;
+}
@@ -0,0 +1,174 @@
+// ItemsSet, ItemsMap and SmallItemsList checked against the standard containers, over random operations.
+
+#include "data_structs.h"
+
+#include <stdio.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#define OPS_COUNT 200000
+
+static int g_Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("[!] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		g_Failures++; \
+	} \
+} while (0)
+
+template<typename TSet>
+std::vector<ULONG> listItems(TSet& set)
+{
+	std::vector<ULONG> items;
+	set.forEachItem([&items](ULONG it) {
+		items.push_back(it);
+	});
+	std::sort(items.begin(), items.end());
+	return items;
+}
+
+// lists the set page by page, following the returned cursors, with the pages of various sizes:
+template<typename TSet>
+void checkPages(TSet& set, const std::set<ULONG>& reference)
+{
+	const size_t pageSizes[] = { 1, 3, 7, 64, reference.size() + 1 };
+	for (size_t pageSize : pageSizes) {
+		std::vector<ULONG> page(pageSize);
+		std::vector<ULONG> listed;
+		size_t cursor = 0;
+		size_t pages = 0;
+		do {
+			size_t nextCursor = 0;
+			const size_t copied = set.copyItemsPage(cursor, nextCursor, page.data(), page.size() * sizeof(ULONG));
+			CHECK(copied <= pageSize);
+			CHECK(nextCursor == 0 || (nextCursor > cursor && copied == pageSize));
+			listed.insert(listed.end(), page.begin(), page.begin() + copied);
+			cursor = nextCursor;
+			pages++;
+		} while (cursor && pages <= reference.size());
+		std::sort(listed.begin(), listed.end());
+		CHECK(listed == std::vector<ULONG>(reference.begin(), reference.end()));
+	}
+}
+
+template<typename TSet>
+void testSet(const char* name, ULONG range)
+{
+	TSet set;
+	set.init();
+	std::set<ULONG> reference;
+	std::mt19937 rng(range);
+
+	for (size_t i = 0; i < OPS_COUNT; i++) {
+		// PIDs are multiples of 4, and 0 is never added:
+		const ULONG pid = (rng() % range) * 4;
+		switch (rng() % 3) {
+		case 0:
+		{
+			const t_add_status status = set.addItem(pid);
+			if (pid == 0) {
+				CHECK(status == ADD_INVALID_ITEM);
+			}
+			else if (reference.insert(pid).second) {
+				CHECK(status == ADD_OK);
+			}
+			else {
+				CHECK(status == ADD_ALREADY_EXIST);
+			}
+			break;
+		}
+		case 1:
+			CHECK(set.deleteItem(pid) == (reference.erase(pid) == 1));
+			break;
+		default:
+			CHECK(set.containsItem(pid) == (reference.count(pid) == 1));
+			break;
+		}
+		CHECK(size_t(set.countItems()) == reference.size());
+		if ((i % 1024) == 0) {
+			CHECK(listItems(set) == std::vector<ULONG>(reference.begin(), reference.end()));
+		}
+	}
+	// copy into the buffer of any size:
+	std::vector<ULONG> buf(reference.size() + 1, 0xFFFFFFFF);
+	const size_t copied = set.copyItems(buf.data(), buf.size() * sizeof(ULONG));
+	CHECK(copied == reference.size());
+	std::sort(buf.begin(), buf.begin() + copied);
+	CHECK(std::equal(reference.begin(), reference.end(), buf.begin()));
+	if (reference.size() > 1) {
+		CHECK(set.copyItems(buf.data(), sizeof(ULONG)) == 1);
+	}
+	checkPages(set, reference);
+	set.destroy();
+	CHECK(set.countItems() == 0);
+	printf("%s (range: %u): %s\n", name, range, g_Failures ? "FAILED" : "OK");
+}
+
+void testMap()
+{
+	ItemsMap<ULONG, int> map;
+	map.init();
+	std::map<ULONG, int> reference;
+	std::mt19937 rng(1);
+
+	for (size_t i = 0; i < OPS_COUNT; i++) {
+		const ULONG pid = (rng() % 2048 + 1) * 4;
+		const int value = int(rng());
+		switch (rng() % 3) {
+		case 0:
+		{
+			const bool isNew = reference.find(pid) == reference.end();
+			reference[pid] = value;
+			CHECK(map.setItem(pid, value) == (isNew ? ADD_OK : ADD_ALREADY_EXIST));
+			break;
+		}
+		case 1:
+			CHECK(map.deleteItem(pid) == (reference.erase(pid) == 1));
+			break;
+		default:
+		{
+			int found = 0;
+			const auto itr = reference.find(pid);
+			CHECK(map.getItem(pid, found) == (itr != reference.end()));
+			if (itr != reference.end()) {
+				CHECK(found == itr->second);
+			}
+			break;
+		}
+		}
+		CHECK(size_t(map.countItems()) == reference.size());
+	}
+	map.destroy();
+	printf("ItemsMap: %s\n", g_Failures ? "FAILED" : "OK");
+}
+
+void testLimit()
+{
+	ItemsSet<ULONG> set;
+	set.init();
+	CHECK(set.initItems(10));
+	for (ULONG i = 1; i <= 10; i++) {
+		CHECK(set.addItem(i * 4) == ADD_OK);
+	}
+	CHECK(!set.canAddItem());
+	CHECK(set.addItem(100) == ADD_LIMIT_EXHAUSTED);
+	CHECK(set.deleteItem(4));
+	CHECK(set.addItem(100) == ADD_OK);
+	set.destroy();
+	printf("ItemsSet limit: %s\n", g_Failures ? "FAILED" : "OK");
+}
+
+int main()
+{
+	testSet<ItemsSet<ULONG> >("ItemsSet", 64);
+	testSet<ItemsSet<ULONG> >("ItemsSet", 4096);
+	testSet<SmallItemsList<ULONG, 8> >("SmallItemsList", 12);
+	testSet<SmallItemsList<ULONG, 8> >("SmallItemsList", 1024);
+	testMap();
+	testLimit();
+	return (g_Failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+// JournalRing: the wrap-around, the producer state kept out of the shared memory,
+// and the concurrent consumers (no torn record may be returned), with the throughput of both sides.
+
+#include "journal_ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define SMALL_CAPACITY 64
+#define STRESS_CAPACITY 1024
+#define STRESS_RECORDS 2000000
+#define STRESS_CONSUMERS 3
+
+static int g_Failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("[!] %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		g_Failures++; \
+	} \
+} while (0)
+
+// all the fields of the record are derived from its number, so that a torn copy can be detected:
+JournalRecord makeRecord(unsigned long long seq)
+{
+	JournalRecord rec = { 0 };
+	rec.timestamp = (long long)(seq * 3);
+	rec.type = (unsigned int)(seq % 8);
+	rec.rootPid = (unsigned int)(seq * 4);
+	rec.pid = (unsigned int)(seq * 8);
+	rec.volumeSerial = seq ^ 0x5555555555555555ULL;
+	rec.fileIdLow = ~seq;
+	rec.fileIdHigh = seq << 1;
+	return rec;
+}
+
+bool isIntact(const JournalRecord& rec, unsigned long long seq)
+{
+	const JournalRecord expected = makeRecord(seq);
+	return rec.timestamp == expected.timestamp
+		&& rec.type == expected.type
+		&& rec.rootPid == expected.rootPid
+		&& rec.pid == expected.pid
+		&& rec.volumeSerial == expected.volumeSerial
+		&& rec.fileIdLow == expected.fileIdLow
+		&& rec.fileIdHigh == expected.fileIdHigh;
+}
+
+JournalHeader* allocRing(unsigned int capacity)
+{
+	return static_cast<JournalHeader*>(::calloc(1, size_t(JournalRing::sizeFor(capacity))));
+}
+
+void testWrapAround()
+{
+	JournalHeader* hdr = allocRing(SMALL_CAPACITY);
+	JournalProducer producer;
+	CHECK(!JournalRing::init(producer, hdr, SMALL_CAPACITY - 1)); // not a power of 2
+	CHECK(JournalRing::init(producer, hdr, SMALL_CAPACITY));
+	CHECK(JournalRing::isValid(hdr));
+
+	JournalRecord out;
+	CHECK(JournalRing::read(hdr, 1, out) == JOURNAL_READ_NOT_YET);
+
+	const unsigned long long total = SMALL_CAPACITY * 3 + 5;
+	for (unsigned long long seq = 1; seq <= total; seq++) {
+		CHECK(JournalRing::write(producer, makeRecord(seq)) == seq);
+	}
+	CHECK(hdr->writeSeq == total);
+	CHECK(JournalRing::oldestSeq(hdr) == total - SMALL_CAPACITY + 1);
+	CHECK(JournalRing::read(hdr, 0, out) == JOURNAL_READ_NOT_YET);
+	CHECK(JournalRing::read(hdr, total + 1, out) == JOURNAL_READ_NOT_YET);
+	CHECK(JournalRing::read(hdr, JournalRing::oldestSeq(hdr) - 1, out) == JOURNAL_READ_OVERWRITTEN);
+	for (unsigned long long seq = JournalRing::oldestSeq(hdr); seq <= total; seq++) {
+		CHECK(JournalRing::read(hdr, seq, out) == JOURNAL_READ_OK);
+		CHECK(out.seq == seq && isIntact(out, seq));
+	}
+	::free(hdr);
+	printf("wrap-around: %s\n", g_Failures ? "FAILED" : "OK");
+}
+
+void testTamperedHeader()
+{
+	JournalHeader* hdr = allocRing(SMALL_CAPACITY);
+	JournalProducer producer;
+	CHECK(JournalRing::init(producer, hdr, SMALL_CAPACITY));
+	JournalRing::write(producer, makeRecord(1));
+
+	// the client overwrites the shared header: the producer must keep writing within the ring
+	hdr->capacity = 0x80000000;
+	hdr->writeSeq = 0x7FFFFFFFFFFFULL;
+	for (unsigned long long seq = 2; seq <= SMALL_CAPACITY + 2; seq++) {
+		CHECK(JournalRing::write(producer, makeRecord(seq)) == seq);
+	}
+	CHECK(hdr->writeSeq == SMALL_CAPACITY + 2);
+	hdr->capacity = SMALL_CAPACITY; // as published
+	JournalRecord out;
+	CHECK(JournalRing::read(hdr, SMALL_CAPACITY + 2, out) == JOURNAL_READ_OK && isIntact(out, SMALL_CAPACITY + 2));
+	::free(hdr);
+	printf("tampered header: %s\n", g_Failures ? "FAILED" : "OK");
+}
+
+struct ConsumerStats {
+	unsigned long long read;
+	unsigned long long overwritten;
+	unsigned long long torn;
+};
+
+void testConcurrentConsumers()
+{
+	JournalHeader* hdr = allocRing(STRESS_CAPACITY);
+	JournalProducer producer;
+	CHECK(JournalRing::init(producer, hdr, STRESS_CAPACITY));
+
+	std::atomic<bool> isDone(false);
+	std::vector<ConsumerStats> stats(STRESS_CONSUMERS);
+	std::vector<std::thread> consumers;
+	for (size_t c = 0; c < STRESS_CONSUMERS; c++) {
+		consumers.emplace_back([hdr, &isDone, &stats, c]() {
+			ConsumerStats& st = stats[c];
+			st.read = st.overwritten = st.torn = 0;
+			unsigned long long next = 1;
+			JournalRecord out;
+			while (true) {
+				const t_journal_read status = JournalRing::read(hdr, next, out);
+				if (status == JOURNAL_READ_OK) {
+					if (!isIntact(out, next)) st.torn++;
+					st.read++;
+					next++;
+				}
+				else if (status == JOURNAL_READ_OVERWRITTEN) {
+					// too slow: skip to the oldest record that is still there
+					st.overwritten++;
+					const unsigned long long oldest = JournalRing::oldestSeq(hdr);
+					next = (oldest > next) ? oldest : next + 1;
+				}
+				else if (isDone) {
+					break;
+				}
+			}
+		});
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned long long seq = 1; seq <= STRESS_RECORDS; seq++) {
+		JournalRing::write(producer, makeRecord(seq));
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	isDone = true;
+	for (auto& th : consumers) {
+		th.join();
+	}
+
+	printf("producer: %.2f M records/s (with %d consumers)\n", STRESS_RECORDS / elapsed.count() / 1e6, STRESS_CONSUMERS);
+	for (size_t c = 0; c < STRESS_CONSUMERS; c++) {
+		printf("consumer %zu: read: %llu, overwritten: %llu\n", c, stats[c].read, stats[c].overwritten);
+		CHECK(stats[c].torn == 0);
+		CHECK(stats[c].read > 0);
+	}
+	::free(hdr);
+	printf("concurrent consumers: %s\n", g_Failures ? "FAILED" : "OK");
+}
+
+void benchConsumer()
+{
+	// a consumer reading the ring that is already full: the cost of the read alone
+	JournalHeader* hdr = allocRing(STRESS_CAPACITY);
+	JournalProducer producer;
+	JournalRing::init(producer, hdr, STRESS_CAPACITY);
+	for (unsigned long long seq = 1; seq <= STRESS_CAPACITY; seq++) {
+		JournalRing::write(producer, makeRecord(seq));
+	}
+	const size_t rounds = STRESS_RECORDS / STRESS_CAPACITY;
+	unsigned long long ok = 0;
+	JournalRecord out;
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (unsigned long long seq = 1; seq <= STRESS_CAPACITY; seq++) {
+			if (JournalRing::read(hdr, seq, out) == JOURNAL_READ_OK) ok++;
+		}
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	CHECK(ok == rounds * STRESS_CAPACITY);
+	printf("consumer: %.2f M records/s (uncontended)\n", ok / elapsed.count() / 1e6);
+	::free(hdr);
+}
+
+int main()
+{
+	testWrapAround();
+	testTamperedHeader();
+	testConcurrentConsumers();
+	benchConsumer();
+	return (g_Failures == 0) ? 0 : 1;
+}
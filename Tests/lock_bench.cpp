@@ -0,0 +1,106 @@
+// Scaling of the set of PIDs queried by many threads: the exclusive lock vs the reader/writer lock.
+// The access pattern follows ProcessNodesList: queries take the lock shared, modifications exclusive.
+
+#include "data_structs.h"
+#include "user_sync.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define WATCHED_PIDS 1024
+#define OPS_PER_THREAD 400000
+#define WRITE_EVERY 64 // one modification per this many queries
+
+template<typename TLock>
+struct GuardedPids
+{
+	void init()
+	{
+		Mutex.Init();
+		Set.init();
+		Set.initItems();
+		for (ULONG i = 1; i <= WATCHED_PIDS; i++) {
+			Set.addItem(i * 4);
+		}
+	}
+
+	void destroy()
+	{
+		Set.destroy();
+	}
+
+	bool containsItem(ULONG pid)
+	{
+		AutoSharedLock<TLock> lock(Mutex);
+		return Set.containsItem(pid);
+	}
+
+	void toggleItem(ULONG pid)
+	{
+		AutoLock<TLock> lock(Mutex);
+		if (!Set.deleteItem(pid)) {
+			Set.addItem(pid);
+		}
+	}
+
+	ItemsSet<ULONG> Set;
+	TLock Mutex;
+};
+
+template<typename TLock>
+double runThreads(GuardedPids<TLock>& pids, unsigned threadsCount)
+{
+	std::vector<std::thread> threads;
+	volatile size_t found = 0;
+
+	const auto start = std::chrono::steady_clock::now();
+	for (unsigned t = 0; t < threadsCount; t++) {
+		threads.emplace_back([&pids, &found, t]() {
+			size_t localFound = 0;
+			ULONG seed = 2166136261UL ^ t;
+			for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+				seed = seed * 1664525UL + 1013904223UL;
+				// half of the queried PIDs are watched:
+				const ULONG pid = ((seed >> 8) % (WATCHED_PIDS * 2) + 1) * 4;
+				if ((i % WRITE_EVERY) == 0) {
+					pids.toggleItem(WATCHED_PIDS * 4 + pid);
+				}
+				else if (pids.containsItem(pid)) {
+					localFound++;
+				}
+			}
+			found = found + localFound;
+		});
+	}
+	for (auto& th : threads) {
+		th.join();
+	}
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return (double(OPS_PER_THREAD) * threadsCount) / elapsed.count();
+}
+
+template<typename TLock>
+double measure(unsigned threadsCount)
+{
+	GuardedPids<TLock> pids;
+	pids.init();
+	const double opsPerSec = runThreads(pids, threadsCount);
+	pids.destroy();
+	return opsPerSec;
+}
+
+int main()
+{
+	unsigned maxThreads = std::thread::hardware_concurrency();
+	if (maxThreads < 4) maxThreads = 4;
+
+	printf("%8s %18s %18s %8s\n", "threads", "mutex [Mops/s]", "shared [Mops/s]", "ratio");
+	for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+		const double exclusive = measure<UserMutex>(threads);
+		const double shared = measure<UserSharedLock>(threads);
+		printf("%8u %18.2f %18.2f %8.2f\n", threads, exclusive / 1e6, shared / 1e6, shared / exclusive);
+	}
+	return 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// The user-mode equivalents of the kernel locks (kernel_sync.h), for the tests and benchmarks
+// of the structures from data_structs.h
+
+#include <mutex>
+#include <shared_mutex>
+
+// Mutex: the shared access is exclusive as well
+
+class UserMutex {
+public:
+	void Init() {}
+
+	void Lock() { _mutex.lock(); }
+	void Unlock() { _mutex.unlock(); }
+
+	void LockShared() { _mutex.lock(); }
+	void UnlockShared() { _mutex.unlock(); }
+
+private:
+	std::mutex _mutex;
+};
+
+// Reader/writer lock (the equivalent of PushLock):
+
+class UserSharedLock {
+public:
+	void Init() {}
+
+	// exclusive access:
+	void Lock() { _lock.lock(); }
+	void Unlock() { _lock.unlock(); }
+
+	// shared access:
+	void LockShared() { _lock.lock_shared(); }
+	void UnlockShared() { _lock.unlock_shared(); }
+
+private:
+	std::shared_mutex _lock;
+};